@@ -0,0 +1,327 @@
+// Microbenchmarks of the control plane: the /properties serializer, the JSON parser and the property writes,
+// plus a check that keyframe requests travel upstream.
+// They run against a mock object whose properties look like rpicamsrc's, so they need neither a camera nor GStreamer plugins.
+//
+//   make bench
+//
+// Reports ns/op and allocations/op; allocations are those made through operator new, which is every std::string and
+// std::vector on these paths, while GValue and GParamSpec internals allocated by GLib itself are not counted.
+
+#define RPI_CAM_CONTROL_NO_MAIN
+#include "../rpi_cam_control.cpp"
+
+#include <chrono>
+#include <iomanip>
+#include <new>
+
+using namespace std::string_view_literals;
+
+namespace {
+  std::atomic<std::size_t> allocations{0};
+}
+
+void * operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (auto ptr = std::malloc(size ? size : 1)) { return ptr; }
+  throw std::bad_alloc{};
+}
+
+void operator delete(void *ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+
+namespace Mock {
+  enum class Exposure { off, automatic, night, backlight, spotlight, sports };
+  enum class Awb { off, automatic, sunlight, cloudy, shade, tungsten, fluorescent };
+  enum class Annotation { none = 0, custom_text = 1 << 0, text = 1 << 1, date = 1 << 2, time = 1 << 3 };
+
+  GType exposure_type() {
+    static GEnumValue const values[] =
+      { {gint(Exposure::off), "GST_RPI_CAM_SRC_EXPOSURE_MODE_OFF", "off"}
+      , {gint(Exposure::automatic), "GST_RPI_CAM_SRC_EXPOSURE_MODE_AUTO", "auto"}
+      , {gint(Exposure::night), "GST_RPI_CAM_SRC_EXPOSURE_MODE_NIGHT", "night"}
+      , {gint(Exposure::backlight), "GST_RPI_CAM_SRC_EXPOSURE_MODE_BACKLIGHT", "backlight"}
+      , {gint(Exposure::spotlight), "GST_RPI_CAM_SRC_EXPOSURE_MODE_SPOTLIGHT", "spotlight"}
+      , {gint(Exposure::sports), "GST_RPI_CAM_SRC_EXPOSURE_MODE_SPORTS", "sports"}
+      , {0, nullptr, nullptr}
+      };
+    static auto const type = g_enum_register_static("MockExposureMode", values);
+    return type;
+  }
+
+  GType awb_type() {
+    static GEnumValue const values[] =
+      { {gint(Awb::off), "GST_RPI_CAM_SRC_AWB_MODE_OFF", "off"}
+      , {gint(Awb::automatic), "GST_RPI_CAM_SRC_AWB_MODE_AUTO", "auto"}
+      , {gint(Awb::sunlight), "GST_RPI_CAM_SRC_AWB_MODE_SUNLIGHT", "sunlight"}
+      , {gint(Awb::cloudy), "GST_RPI_CAM_SRC_AWB_MODE_CLOUDY", "cloudy"}
+      , {gint(Awb::shade), "GST_RPI_CAM_SRC_AWB_MODE_SHADE", "shade"}
+      , {gint(Awb::tungsten), "GST_RPI_CAM_SRC_AWB_MODE_TUNGSTEN", "tungsten"}
+      , {gint(Awb::fluorescent), "GST_RPI_CAM_SRC_AWB_MODE_FLUORESCENT", "fluorescent"}
+      , {0, nullptr, nullptr}
+      };
+    static auto const type = g_enum_register_static("MockAwbMode", values);
+    return type;
+  }
+
+  GType annotation_type() {
+    static GFlagsValue const values[] =
+      { {guint(Annotation::custom_text), "GST_RPI_CAM_SRC_ANNOTATION_MODE_CUSTOM_TEXT", "custom-text"}
+      , {guint(Annotation::text), "GST_RPI_CAM_SRC_ANNOTATION_MODE_TEXT", "text"}
+      , {guint(Annotation::date), "GST_RPI_CAM_SRC_ANNOTATION_MODE_DATE", "date"}
+      , {guint(Annotation::time), "GST_RPI_CAM_SRC_ANNOTATION_MODE_TIME", "time"}
+      , {0, nullptr, nullptr}
+      };
+    static auto const type = g_flags_register_static("MockAnnotationMode", values);
+    return type;
+  }
+
+  // The properties, by id; id 0 is reserved by GObject
+  std::vector<GParamSpec*> specs() {
+    auto const flags = GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+    return
+      { nullptr
+      , g_param_spec_int("bitrate", "Bitrate", "Bitrate for encoding. 0 for VBR using quantisation-parameter", 0, 25000000, 17000000, flags)
+      , g_param_spec_int("keyframe-interval", "Keyframe Interface", "Interval (in frames) between I frames. -1 = automatic, 0 = single-keyframe", -1, G_MAXINT, -1, flags)
+      , g_param_spec_int("quantisation-parameter", "Quantisation Parameter", "Quantisation parameter to use for VBR encoding", 0, 51, 0, flags)
+      , g_param_spec_boolean("preview", "Preview Window", "Display preview window overlay", TRUE, flags)
+      , g_param_spec_boolean("fullscreen", "Fullscreen Preview", "Display preview window full screen", TRUE, flags)
+      , g_param_spec_uint("preview-opacity", "Preview Opacity", "Opacity to use for the preview window", 0, 255, 255, flags)
+      , g_param_spec_int("sharpness", "Sharpness", "Image capture sharpness", -100, 100, 0, flags)
+      , g_param_spec_int("contrast", "Contrast", "Image capture contrast", -100, 100, 0, flags)
+      , g_param_spec_int("brightness", "Brightness", "Image capture brightness", 0, 100, 50, flags)
+      , g_param_spec_int("saturation", "Saturation", "Image capture saturation", -100, 100, 0, flags)
+      , g_param_spec_int("iso", "ISO", "ISO value to use (0 = Auto)", 0, 3200, 0, flags)
+      , g_param_spec_boolean("video-stabilisation", "Video Stabilisation", "Enable or disable video stabilisation", FALSE, flags)
+      , g_param_spec_int("exposure-compensation", "EV compensation", "Exposure Value compensation", -10, 10, 0, flags)
+      , g_param_spec_enum("exposure-mode", "Exposure Mode", "Camera exposure mode to use", exposure_type(), gint(Exposure::automatic), flags)
+      , g_param_spec_enum("awb-mode", "Automatic White Balance Mode", "White Balance mode", awb_type(), gint(Awb::automatic), flags)
+      , g_param_spec_float("awb-gain-red", "AWB Red Gain", "Manual AWB Gain for red channel when awb-mode=off", 0, 8.0, 0, flags)
+      , g_param_spec_float("awb-gain-blue", "AWB Blue Gain", "Manual AWB Gain for blue channel when awb-mode=off", 0, 8.0, 0, flags)
+      , g_param_spec_int("shutter-speed", "Shutter Speed", "Set a fixed shutter speed, in microseconds. (0 = Auto)", 0, 6000000, 0, flags)
+      , g_param_spec_int("rotation", "Rotation", "Rotate captured image (0, 90, 180, 270 degrees)", 0, 270, 0, flags)
+      , g_param_spec_boolean("hflip", "Horizontal Flip", "Flip capture horizontally", FALSE, flags)
+      , g_param_spec_boolean("vflip", "Vertical Flip", "Flip capture vertically", FALSE, flags)
+      , g_param_spec_flags("annotation-mode", "Annotation Mode", "Flags to control annotation of the output video", annotation_type(), 0, flags)
+      , g_param_spec_string("annotation-text", "Annotation Text", "Text string to annotate onto video when annotation-mode flags include 'custom-text'", "", flags)
+      , g_param_spec_int("camera-number", "Camera Number", "Which camera to use on a multi-camera system - 0 or 1", 0, 1, 0, GParamFlags(flags | G_PARAM_CONSTRUCT_ONLY))
+      };
+  }
+}
+
+struct MockCamera {
+  GObject parent;
+  // Values are stored generically, one GValue per property id, since only the property machinery is being measured
+  std::vector<GValue> *values;
+};
+
+struct MockCameraClass {
+  GObjectClass parent_class;
+};
+
+G_DEFINE_TYPE(MockCamera, mock_camera, G_TYPE_OBJECT)
+
+static void mock_camera_set_property(GObject *object, guint id, GValue const *value, GParamSpec *) {
+  g_value_copy(value, &(*reinterpret_cast<MockCamera*>(object)->values)[id]);
+}
+
+static void mock_camera_get_property(GObject *object, guint id, GValue *value, GParamSpec *) {
+  g_value_copy(&(*reinterpret_cast<MockCamera*>(object)->values)[id], value);
+}
+
+static void mock_camera_finalize(GObject *object) {
+  auto const camera = reinterpret_cast<MockCamera*>(object);
+  for (auto& value : *camera->values) {
+    if (G_IS_VALUE(&value)) { g_value_unset(&value); }
+  }
+  delete camera->values;
+  G_OBJECT_CLASS(mock_camera_parent_class)->finalize(object);
+}
+
+static void mock_camera_class_init(MockCameraClass *klass) {
+  auto const object_class = G_OBJECT_CLASS(klass);
+  object_class->set_property = mock_camera_set_property;
+  object_class->get_property = mock_camera_get_property;
+  object_class->finalize = mock_camera_finalize;
+
+  auto const specs = Mock::specs();
+  for (auto id = guint{1}; id < specs.size(); ++id) {
+    g_object_class_install_property(object_class, id, specs[id]);
+  }
+}
+
+static void mock_camera_init(MockCamera *camera) {
+  guint length = 0;
+  auto const specs = g_object_class_list_properties(G_OBJECT_GET_CLASS(camera), &length);
+  camera->values = new std::vector<GValue>(length + 1, GValue G_VALUE_INIT);
+  for (auto i = guint{}; i < length; ++i) {
+    auto& value = (*camera->values)[specs[i]->param_id];
+    g_value_init(&value, G_PARAM_SPEC_VALUE_TYPE(specs[i]));
+    g_param_value_set_default(specs[i], &value);
+  }
+  g_free(specs);
+}
+
+namespace Bench {
+  using Clock = std::chrono::steady_clock;
+
+  // Runs f repeatedly for about half a second, after a warm up, and prints the mean time and allocations per call.
+  // A case that throws is reported as failed, and the remaining ones still run.
+  template <typename F>
+  void run(char const *name, F&& f) {
+    std::cout << std::left << std::setw(40) << name << std::right;
+    try {
+      for (auto i = 0; i < 1000; ++i) { f(); }
+
+      auto iterations = std::size_t{};
+      auto const allocations_before = allocations.load();
+      auto const start = Clock::now();
+      auto elapsed = Clock::duration{};
+      do {
+        for (auto i = 0; i < 1000; ++i) { f(); }
+        iterations += 1000;
+        elapsed = Clock::now() - start;
+      } while (elapsed < std::chrono::milliseconds{500});
+      auto const allocated = allocations.load() - allocations_before;
+
+      auto const ns = std::chrono::duration<double, std::nano>{elapsed}.count() / double(iterations);
+      std::cout
+        << std::fixed << std::setprecision(1) << std::setw(12) << ns << " ns/op"
+        << std::setprecision(2) << std::setw(10) << double(allocated) / double(iterations) << " allocs/op\n";
+    } catch (std::exception const & e) {
+      std::cout << "  failed: " << e.what() << '\n';
+    }
+  }
+
+  // Prints whether a check that is not timed holds
+  void check(char const *name, bool ok) {
+    std::cout << std::left << std::setw(40) << name << std::right << (ok ? "  ok\n" : "  FAILED\n");
+  }
+
+  // Keeps the optimiser from discarding a result
+  template <typename T>
+  void keep(T const & value) {
+    asm volatile("" : : "g"(&value) : "memory");
+  }
+}
+
+// Links a sink pad, as VideoStream and PropertyWriter request keyframes from, to a pad standing in for the encoder's src pad,
+// and checks that the request travels up to it and is taken
+bool keyframe_request_reaches_encoder() {
+  auto const encoder = gst_pad_new("src", GST_PAD_SRC);
+  auto const sink = gst_pad_new("sink", GST_PAD_SINK);
+  gst_pad_set_active(encoder, TRUE);
+  gst_pad_set_active(sink, TRUE);
+  gst_pad_link(encoder, sink);
+
+  auto seen = false;
+  gst_pad_add_probe
+    ( encoder
+    , GST_PAD_PROBE_TYPE_EVENT_UPSTREAM
+    , [] (GstPad *, GstPadProbeInfo *info, gpointer data) {
+        auto const event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (!gst_video_event_is_force_key_unit(event)) { return GST_PAD_PROBE_OK; }
+        *static_cast<bool*>(data) = true;
+        gst_event_unref(event);
+        return GST_PAD_PROBE_HANDLED;
+      }
+    , &seen
+    , nullptr
+    );
+  auto const accepted = Gst::request_keyframe(sink);
+
+  gst_object_unref(sink);
+  gst_object_unref(encoder);
+  return accepted && seen;
+}
+
+int main() {
+  gst_init(nullptr, nullptr);
+  Bench::check("Gst::request_keyframe reaches the encoder", keyframe_request_reaches_encoder());
+
+  auto camera = GLib::Object<>{G_OBJECT(g_object_new(mock_camera_get_type(), nullptr))};
+  auto const schema = PropertiesSchema{camera};
+
+  auto out = JsonWriter{};
+  Bench::run
+    ( "PropertiesSchema::write"
+    , [&] () {
+        out.clear();
+        schema.write(&out);
+        Bench::keep(out);
+      }
+    );
+
+  auto const bitrate = camera.property("bitrate");
+  auto const exposure = camera.property("exposure-mode");
+  Bench::run
+    ( "PropertiesSchema::writeChange (int)"
+    , [&] () {
+        out.clear();
+        schema.writeChange(&out, bitrate);
+        Bench::keep(out);
+      }
+    );
+  Bench::run
+    ( "PropertiesSchema::writeChange (enum)"
+    , [&] () {
+        out.clear();
+        schema.writeChange(&out, exposure);
+        Bench::keep(out);
+      }
+    );
+
+  out.clear();
+  schema.write(&out);
+  auto const properties = out.release();
+  Bench::run
+    ( "JsonParser (/properties document)"
+    , [&] () {
+        auto parser = JsonParser{properties};
+        auto count = 0;
+        parser.array([&] (JsonParser& parser) { parser.object([&] (std::string_view, JsonParser::Value) { ++count; }); });
+        parser.finish();
+        Bench::keep(count);
+      }
+    );
+
+  auto const set_property = R"({"name":"bitrate","type":"GParamInt","value":8000000})"sv;
+  Bench::run
+    ( "parse_set_property (int)"
+    , [&] () {
+        auto assignments = parse_set_property(schema, set_property);
+        Bench::keep(assignments);
+      }
+    );
+
+  auto const set_enum = R"({"name":"exposure-mode","value":"night"})"sv;
+  Bench::run
+    ( "parse_set_property (enum)"
+    , [&] () {
+        auto assignments = parse_set_property(schema, set_enum);
+        Bench::keep(assignments);
+      }
+    );
+
+  auto const set_properties =
+    R"({"exposure-mode":"sports","iso":800,"shutter-speed":10000,"awb-mode":"tungsten","bitrate":4000000,"annotation-text":"Gate \"A\""})"sv;
+  Bench::run
+    ( "parse_set_properties (6 properties)"
+    , [&] () {
+        auto assignments = parse_set_properties(schema, set_properties);
+        Bench::keep(assignments);
+      }
+    );
+
+  auto const assignments = parse_set_properties(schema, set_properties);
+  Bench::run
+    ( "PropertyAssignments::apply (6 properties)"
+    , [&] () {
+        assignments.apply(camera);
+      }
+    );
+}
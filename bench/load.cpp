@@ -0,0 +1,174 @@
+// HTTP load generator for the control plane, standing in for many dashboards polling and writing at once.
+//
+//   load [--host HOST] [--port PORT] [--connections N] [--seconds S] [--body JSON] PATH
+//
+// Each connection runs on its own thread and sends requests back to back over keep-alive: a GET of PATH, or a POST of
+// --body to it when one is given. At the end it prints the total request rate and the latency percentiles over all
+// connections. Responses other than 2xx and 304 are counted as errors.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+  using Clock = std::chrono::steady_clock;
+
+  struct Options {
+    std::string host = "localhost";
+    std::string port = "9001";
+    int connections = 8;
+    int seconds = 10;
+    std::string body;
+    bool post = false;
+    std::string path;
+  };
+
+  struct Result {
+    std::vector<double> latencies; // in microseconds
+    std::size_t errors = 0;
+  };
+
+  int connect(Options const & options) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addresses = nullptr;
+    if (auto const error = getaddrinfo(options.host.c_str(), options.port.c_str(), &hints, &addresses)) {
+      std::cerr << options.host << ": " << gai_strerror(error) << '\n';
+      return -1;
+    }
+
+    auto fd = -1;
+    for (auto address = addresses; address; address = address->ai_next) {
+      fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+      if (fd < 0) { continue; }
+      if (::connect(fd, address->ai_addr, address->ai_addrlen) == 0) { break; }
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(addresses);
+    return fd;
+  }
+
+  // Reads one response, returning its status or 0 if the connection failed.
+  // Only Content-Length framing is understood, which is all uWS uses for these routes.
+  int readResponse(int fd, std::string& buffer) {
+    auto header_end = std::string::npos;
+    while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+      char chunk[16 * 1024];
+      auto const n = read(fd, chunk, sizeof(chunk));
+      if (n <= 0) { return 0; }
+      buffer.append(chunk, std::size_t(n));
+    }
+
+    auto const headers = std::string_view{buffer}.substr(0, header_end);
+    if (headers.size() < 12) { return 0; }
+    auto const status = std::atoi(std::string{headers.substr(9, 3)}.c_str());
+
+    auto length = std::size_t{};
+    for (auto line = headers.find("\r\n"); line != std::string_view::npos; line = headers.find("\r\n", line + 2)) {
+      auto const field = headers.substr(line + 2, 15);
+      if (field.size() == 15 && strncasecmp(field.data(), "content-length:", 15) == 0) {
+        length = std::size_t(std::strtoul(headers.data() + line + 17, nullptr, 10));
+      }
+    }
+
+    auto const total = header_end + 4 + length;
+    while (buffer.size() < total) {
+      char chunk[16 * 1024];
+      auto const n = read(fd, chunk, sizeof(chunk));
+      if (n <= 0) { return 0; }
+      buffer.append(chunk, std::size_t(n));
+    }
+    buffer.erase(0, total);
+    return status;
+  }
+
+  void run(Options const & options, Clock::time_point end, Result& result) {
+    auto request = std::string{options.post ? "POST " : "GET "} + options.path + " HTTP/1.1\r\nHost: " + options.host + "\r\n";
+    if (options.post) {
+      request += "Content-Type: application/json\r\nContent-Length: " + std::to_string(options.body.size()) + "\r\n\r\n" + options.body;
+    } else {
+      request += "\r\n";
+    }
+
+    auto fd = connect(options);
+    auto buffer = std::string{};
+    while (fd >= 0 && Clock::now() < end) {
+      auto const start = Clock::now();
+      if (write(fd, request.data(), request.size()) != ssize_t(request.size())) { break; }
+      auto const status = readResponse(fd, buffer);
+      if (status == 0) { break; }
+
+      result.latencies.push_back(std::chrono::duration<double, std::micro>{Clock::now() - start}.count());
+      if (!((status >= 200 && status < 300) || status == 304)) { ++result.errors; }
+    }
+    if (fd >= 0) { close(fd); }
+  }
+
+  double percentile(std::vector<double> const & sorted, double p) {
+    if (sorted.empty()) { return 0; }
+    return sorted[std::min(sorted.size() - 1, std::size_t(p * double(sorted.size())))];
+  }
+
+  void usage(char const *name) {
+    std::cerr << "Usage: " << name << " [--host HOST] [--port PORT] [--connections N] [--seconds S] [--body JSON] PATH\n";
+  }
+}
+
+int main(int argc, char **argv) {
+  auto options = Options{};
+  for (auto i = 1; i < argc; ++i) {
+    auto const arg = std::string_view{argv[i]};
+    auto const next = [&] () -> char const * {
+      if (i + 1 >= argc) { usage(argv[0]); std::exit(1); }
+      return argv[++i];
+    };
+    if (arg == "--host") { options.host = next(); }
+    else if (arg == "--port") { options.port = next(); }
+    else if (arg == "--connections") { options.connections = std::max(1, std::atoi(next())); }
+    else if (arg == "--seconds") { options.seconds = std::max(1, std::atoi(next())); }
+    else if (arg == "--body") { options.body = next(); options.post = true; }
+    else if (arg.substr(0, 1) == "/") { options.path = std::string{arg}; }
+    else { usage(argv[0]); return 1; }
+  }
+  if (options.path.empty()) { usage(argv[0]); return 1; }
+
+  auto results = std::vector<Result>(std::size_t(options.connections));
+  auto threads = std::vector<std::thread>{};
+  auto const start = Clock::now();
+  auto const end = start + std::chrono::seconds{options.seconds};
+  for (auto& result : results) {
+    threads.emplace_back(run, std::cref(options), end, std::ref(result));
+  }
+  for (auto& thread : threads) { thread.join(); }
+  auto const elapsed = std::chrono::duration<double>{Clock::now() - start}.count();
+
+  auto latencies = std::vector<double>{};
+  auto errors = std::size_t{};
+  for (auto& result : results) {
+    latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+    errors += result.errors;
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  std::printf("%s %s: %zu requests, %zu errors, %d connections, %.1fs\n", options.post ? "POST" : "GET", options.path.c_str(), latencies.size(), errors, options.connections, elapsed);
+  std::printf("%.0f req/s, latency p50 %.0fus p90 %.0fus p99 %.0fus max %.0fus\n"
+    , double(latencies.size()) / elapsed
+    , percentile(latencies, 0.5), percentile(latencies, 0.9), percentile(latencies, 0.99)
+    , latencies.empty() ? 0.0 : latencies.back()
+    );
+  return latencies.empty() ? 1 : 0;
+}
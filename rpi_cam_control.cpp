@@ -1,17 +1,44 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
 #include <string>
 #include <thread>
 #include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+#include <pthread.h>
+#include <sched.h>
+
 #include <gsl/span>
 
 #include <uWebSockets/App.h>
 
+#include <zlib.h>
+
 extern "C" {
 #include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/video/video.h>
 }
 
 using namespace std::string_literals;
@@ -25,16 +52,137 @@ class owning_span : public gsl::span<T> {
     owning_span(std::unique_ptr<T, Deleter> first, typename gsl::span<T>::size_type count) : gsl::span<T>{first.get(), count}, owner{std::move(first)} {}
 };
 
+// Lock-free ring buffer for exactly one producer thread and one consumer thread
+template <typename T, std::size_t capacity>
+class SpscQueue {
+  private:
+    std::array<T, capacity> slots;
+    alignas(64) std::atomic<std::size_t> head = 0; // next slot to pop, written by the consumer
+    alignas(64) std::atomic<std::size_t> tail = 0; // next slot to push, written by the producer
+
+  public:
+    bool push(T value) {
+      auto const t = tail.load(std::memory_order_relaxed);
+      if (t - head.load(std::memory_order_acquire) == capacity) { return false; }
+      slots[t % capacity] = std::move(value);
+      tail.store(t + 1);
+      return true;
+    }
+
+    std::optional<T> pop() {
+      auto const h = head.load(std::memory_order_relaxed);
+      if (h == tail.load()) { return std::nullopt; }
+      auto value = std::optional<T>{std::move(slots[h % capacity])};
+      slots[h % capacity] = T{};
+      head.store(h + 1, std::memory_order_release);
+      return value;
+    }
+};
+
 namespace GLib {
   using ref_t = gpointer (*)(gpointer);
   using unref_t = void (*)(gpointer);
   
+  // An owned GValue, unset when it goes out of scope
+  class Value {
+    private:
+      GValue value = G_VALUE_INIT;
+
+    public:
+      Value() = default;
+
+      explicit Value(GType type) {
+        g_value_init(&value, type);
+      }
+
+      // Takes ownership of an initialised GValue
+      static Value adopt(GValue value) {
+        auto result = Value{};
+        result.value = value;
+        return result;
+      }
+
+      Value(Value const & other) {
+        if (G_IS_VALUE(&other.value)) {
+          g_value_init(&value, G_VALUE_TYPE(&other.value));
+          g_value_copy(&other.value, &value);
+        }
+      }
+
+      Value(Value&& other) : value{std::exchange(other.value, GValue G_VALUE_INIT)} {}
+
+      Value& operator=(Value other) {
+        std::swap(value, other.value);
+        return *this;
+      }
+
+      ~Value() {
+        if (G_IS_VALUE(&value)) {
+          g_value_unset(&value);
+        }
+      }
+
+      GValue * get() {
+        return &value;
+      }
+
+      GValue const * get() const {
+        return &value;
+      }
+
+      GType type() const {
+        return G_VALUE_TYPE(&value);
+      }
+
+      // Gives up ownership of the GValue
+      GValue release() {
+        return std::exchange(value, GValue G_VALUE_INIT);
+      }
+  };
+
+  // A property of an object, with its GParamSpec resolved up front.
+  // Reads go through a scratch value owned by the handle, so a handle must only be read from one thread at a time,
+  // and pointers such as get<char const *>() returns stay valid until the next read through the same handle.
   class Property {
     private:
       GObject *object;
-      char const *name;
+      GParamSpec *spec;
+      Value scratch;
+
+      Property(GObject *object, GParamSpec *spec) : object{object}, spec{spec} {
+        if (spec) {
+          scratch = Value{G_PARAM_SPEC_VALUE_TYPE(spec)};
+        }
+      }
 
-      Property(GObject *object, char const *name) : object{object}, name{name} {}
+      Property(GObject *object, char const *name) : Property{object, g_object_class_find_property(G_OBJECT_GET_CLASS(object), name)} {
+        if (!spec) { g_warning("%s has no property %s", G_OBJECT_TYPE_NAME(object), name); }
+      }
+
+      template <typename T>
+      static GType g_type() {
+        if constexpr (std::is_same_v<T, bool>) { return G_TYPE_BOOLEAN; }
+        else if constexpr (std::is_same_v<T, gint>) { return G_TYPE_INT; }
+        else if constexpr (std::is_same_v<T, guint>) { return G_TYPE_UINT; }
+        else if constexpr (std::is_same_v<T, gint64>) { return G_TYPE_INT64; }
+        else if constexpr (std::is_same_v<T, guint64>) { return G_TYPE_UINT64; }
+        else if constexpr (std::is_same_v<T, gfloat>) { return G_TYPE_FLOAT; }
+        else if constexpr (std::is_same_v<T, gdouble>) { return G_TYPE_DOUBLE; }
+        else if constexpr (std::is_same_v<T, char const *>) { return G_TYPE_STRING; }
+        else { static_assert(!sizeof(T), "Unsupported property type"); }
+      }
+
+      template <typename T>
+      static T unpack(GValue const * value) {
+        if constexpr (std::is_same_v<T, bool>) { return g_value_get_boolean(value); }
+        else if constexpr (std::is_same_v<T, gint>) { return g_value_get_int(value); }
+        else if constexpr (std::is_same_v<T, guint>) { return g_value_get_uint(value); }
+        else if constexpr (std::is_same_v<T, gint64>) { return g_value_get_int64(value); }
+        else if constexpr (std::is_same_v<T, guint64>) { return g_value_get_uint64(value); }
+        else if constexpr (std::is_same_v<T, gfloat>) { return g_value_get_float(value); }
+        else if constexpr (std::is_same_v<T, gdouble>) { return g_value_get_double(value); }
+        else if constexpr (std::is_same_v<T, char const *>) { return g_value_get_string(value); }
+      }
 
     public:
       Property() = delete;
@@ -43,46 +191,62 @@ namespace GLib {
       Property& operator=(const Property&) = default;
       Property& operator=(Property&&) = default;
 
-      void operator=(GValue value) {
-        g_object_set_property(object, name, &value);
+      GParamSpec * param_spec() const {
+        return spec;
+      }
+
+      void operator=(GValue const & value) {
+        if (!spec) { return; }
+        g_object_set_property(object, g_param_spec_get_name(spec), &value);
+      }
+
+      void operator=(Value const & value) {
+        *this = *value.get();
       }
 
       void operator=(bool value) {
-        GValue g_value = G_VALUE_INIT;
-        g_value_init(&g_value, G_TYPE_BOOLEAN);
-        g_value_set_boolean(&g_value, value);
+        auto g_value = Value{G_TYPE_BOOLEAN};
+        g_value_set_boolean(g_value.get(), value);
         *this = g_value;
       }
 
       void operator=(gint value) {
-        GValue g_value = G_VALUE_INIT;
-        g_value_init(&g_value, G_TYPE_INT);
-        g_value_set_int(&g_value, value);
+        auto g_value = Value{G_TYPE_INT};
+        g_value_set_int(g_value.get(), value);
         *this = g_value;
       }
 
       void operator=(guint value) {
-        GValue g_value = G_VALUE_INIT;
-        g_value_init(&g_value, G_TYPE_UINT);
-        g_value_set_uint(&g_value, value);
+        auto g_value = Value{G_TYPE_UINT};
+        g_value_set_uint(g_value.get(), value);
+        *this = g_value;
+      }
+
+      void operator=(gint64 value) {
+        auto g_value = Value{G_TYPE_INT64};
+        g_value_set_int64(g_value.get(), value);
+        *this = g_value;
+      }
+
+      void operator=(guint64 value) {
+        auto g_value = Value{G_TYPE_UINT64};
+        g_value_set_uint64(g_value.get(), value);
         *this = g_value;
       }
 
       void operator=(gfloat value) {
-        GValue g_value = G_VALUE_INIT;
-        g_value_init(&g_value, G_TYPE_FLOAT);
-        g_value_set_float(&g_value, value);
+        auto g_value = Value{G_TYPE_FLOAT};
+        g_value_set_float(g_value.get(), value);
         *this = g_value;
       }
 
       void operator=(char const *value) {
-        GValue g_value = G_VALUE_INIT;
-        g_value_init(&g_value, G_TYPE_STRING);
-        g_value_set_string(&g_value, value);
+        auto g_value = Value{G_TYPE_STRING};
+        g_value_set_string(g_value.get(), value);
         *this = g_value;
       }
 
-      void operator=(std::string value) {
+      void operator=(std::string const & value) {
         *this = value.c_str();
       }
 
@@ -90,44 +254,41 @@ namespace GLib {
         *this = std::string{value};
       }
 
-      GValue g_value(GType g_type) {
-        GValue g_value = G_VALUE_INIT;
-        g_value_init(&g_value, g_type);
-        g_object_get_property(object, name, &g_value);
-        return g_value;
-      }
-
-      template <typename T>
-      T get();
-
-      template <>
-      bool get() {
-        auto g_value = this->g_value(G_TYPE_BOOLEAN);
-        return g_value_get_boolean(&g_value);
+      // Reads the current value into the scratch value, which stays valid until the next read
+      GValue const & value() {
+        if (spec) {
+          if (scratch.type() == G_PARAM_SPEC_VALUE_TYPE(spec)) {
+            g_value_reset(scratch.get());
+          } else {
+            scratch = Value{G_PARAM_SPEC_VALUE_TYPE(spec)};
+          }
+          g_object_get_property(object, g_param_spec_get_name(spec), scratch.get());
+        }
+        return *scratch.get();
       }
 
-      template <>
-      gint get() {
-        auto g_value = this->g_value(G_TYPE_INT);
-        return g_value_get_int(&g_value);
+      // Reads the current value into a new value, for use where the scratch value may be in use on another thread
+      Value copy() const {
+        if (!spec) { return Value{}; }
+        auto result = Value{G_PARAM_SPEC_VALUE_TYPE(spec)};
+        g_object_get_property(object, g_param_spec_get_name(spec), result.get());
+        return result;
       }
 
-      template <>
-      guint get() {
-        auto g_value = this->g_value(G_TYPE_UINT);
-        return g_value_get_uint(&g_value);
-      }
+      template <typename T>
+      T get() {
+        if (!spec) { return T{}; }
 
-      template <>
-      gfloat get() {
-        auto g_value = this->g_value(G_TYPE_FLOAT);
-        return g_value_get_float(&g_value);
-      }
+        auto const & current = value();
+        if (G_VALUE_TYPE(&current) == g_type<T>()) {
+          return unpack<T>(&current);
+        }
 
-      template <>
-      char const * get() {
-        auto g_value = this->g_value(G_TYPE_STRING);
-        return g_value_get_string(&g_value);
+        // Kept in the scratch value so that a converted string outlives this call
+        auto converted = Value{g_type<T>()};
+        g_value_transform(&current, converted.get());
+        scratch = std::move(converted);
+        return unpack<T>(scratch.get());
       }
 
       template <ref_t ref, unref_t unref>
@@ -167,6 +328,10 @@ namespace GLib {
         return Property{object, name};
       }
 
+      Property operator[](GParamSpec *property) {
+        return Property{object, property};
+      }
+
       virtual ~Object() {
         if (object) {
           unref(object);
@@ -182,6 +347,20 @@ namespace GLib {
         return owning_span{std::move(properties_ptr), gsl::narrow<int>(properties_length)};
       }
 
+      // Sets several properties at once, with change notifications held until all of them are applied
+      void set(std::vector<char const *> const & names, std::vector<GValue> const & values) {
+        g_object_setv(object, gsl::narrow<guint>(names.size()), const_cast<char const **>(names.data()), values.data());
+      }
+
+      template <typename... Args>
+      void emit(char const *signal, Args... args) {
+        g_signal_emit_by_name(object, signal, args...);
+      }
+
+      gulong connect(char const *signal, GCallback callback, gpointer data) {
+        return g_signal_connect(object, signal, callback, data);
+      }
+
       auto property(char const *name) {
         return g_object_class_find_property(G_OBJECT_GET_CLASS(object), name);
       }
@@ -192,6 +371,12 @@ namespace Gst {
   class Object : public GLib::Object<&gst_object_ref, &gst_object_unref> {
     protected:
       Object(GstObject *object) : GLib::Object<&gst_object_ref, &gst_object_unref>{G_OBJECT(object)} {}
+
+    public:
+      // Sets a property from its string form, as gst-launch does, so enums can be given by nick
+      void set_from_string(char const *name, char const *value) {
+        gst_util_set_object_arg(object, name, value);
+      }
   };
 
   class Element : public Object {
@@ -200,7 +385,12 @@ namespace Gst {
 
     public:
       Element(char const *factoryname, char const *name) : Object{GST_OBJECT(gst_element_factory_make(factoryname, name))} {
-        if (!object) { g_warning("Failed to create %s", name); }
+        if (!object) {
+          g_warning("Failed to create %s", name);
+          return;
+        }
+        // The handle owns a full reference, so a bin the element is added to holds its own and the handle can go out of scope
+        gst_object_ref_sink(object);
       }
 
       static void link(Element src, Element dest) {
@@ -211,8 +401,25 @@ namespace Gst {
         if (!gst_element_link_filtered(GST_ELEMENT(src.object), GST_ELEMENT(dest.object), filter)) { g_warning ("Failed to link %s to %s", src["name"].get<char const *>(), dest["name"].get<char const *>()); }
       }
 
-      void set_state(GstState state) {
-        if (!gst_element_set_state(GST_ELEMENT(object), state)) { g_warning("Failed to start %s", (*this)["name"].get<char const *>()); }
+      // For request and sometimes pads, which link() cannot pick by itself
+      static void link_pads(Element src, char const *src_pad, Element dest, char const *dest_pad) {
+        if (!gst_element_link_pads(GST_ELEMENT(src.object), src_pad, GST_ELEMENT(dest.object), dest_pad)) { g_warning ("Failed to link %s.%s to %s.%s", src["name"].get<char const *>(), src_pad, dest["name"].get<char const *>(), dest_pad); }
+      }
+
+      GstElement * get() const {
+        return GST_ELEMENT(object);
+      }
+
+      auto static_pad(char const *name) const {
+        return std::unique_ptr<GstPad, void (*)(gpointer)>{gst_element_get_static_pad(GST_ELEMENT(object), name), gst_object_unref};
+      }
+
+      bool set_state(GstState state) {
+        if (!gst_element_set_state(GST_ELEMENT(object), state)) {
+          g_warning("Failed to change the state of %s", (*this)["name"].get<char const *>());
+          return false;
+        }
+        return true;
       }
 
       friend class Bin;
@@ -223,374 +430,5132 @@ namespace Gst {
       Bin(GstElement *element) : Element{element} {}
 
     public:
+      // A bin built from a gst-launch description, with its unlinked pads ghosted, or nothing if it does not parse
+      static std::optional<Bin> parse(char const *description, GError **error) {
+        auto const bin = gst_parse_bin_from_description(description, TRUE, error);
+        if (!bin) { return std::nullopt; }
+        return Bin{GST_ELEMENT(gst_object_ref_sink(bin))};
+      }
+
       void add(Element element) {
         gst_bin_add(GST_BIN(object), GST_ELEMENT(element.object));
       }
+
+      // The element called name anywhere inside the bin, if there is one
+      std::optional<Element> by_name(char const *name) const {
+        auto const element = gst_bin_get_by_name(GST_BIN(object), name);
+        if (!element) { return std::nullopt; }
+        return Element{element};
+      }
   };
 
   class Pipeline : public Bin {
     public:
-      Pipeline(char const *name) : Bin{gst_pipeline_new(name)} {}
+      Pipeline(char const *name) : Bin{GST_ELEMENT(gst_object_ref_sink(gst_pipeline_new(name)))} {}
   };
+
+  // A GST_TYPE_CAPS value with its own reference to caps
+  inline GLib::Value caps_value(GstCaps *caps) {
+    auto value = GLib::Value{GST_TYPE_CAPS};
+    gst_value_set_caps(value.get(), caps);
+    return value;
+  }
+
+  inline bool has_factory(char const *name) {
+    auto const factory = gst_element_factory_find(name);
+    if (factory) { gst_object_unref(factory); }
+    return factory;
+  }
+
+  inline GLib::Value caps_value(char const *caps) {
+    auto const parsed = gst_caps_from_string(caps);
+    auto value = caps_value(parsed);
+    gst_caps_unref(parsed);
+    return value;
+  }
+
+  // Asks the encoder upstream of sink_pad for a keyframe at once, returning whether an element upstream took the request.
+  // Upstream events are pushed from a sink pad; sending one to a sink pad has it travel the wrong way, and it is dropped.
+  inline bool request_keyframe(GstPad *sink_pad) {
+    return gst_pad_push_event(sink_pad, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+  }
 }
 
-struct json_literal {
-  std::string raw;
+// Accumulates a JSON document in one buffer that is reused between responses, so a response is a single write
+class JsonWriter {
+  private:
+    std::string buffer;
+
+  public:
+    explicit JsonWriter(std::size_t capacity = 16 * 1024) {
+      buffer.reserve(capacity);
+    }
+
+    void clear() {
+      buffer.clear();
+    }
+
+    std::string_view view() const {
+      return buffer;
+    }
+
+    std::string release() {
+      return std::move(buffer);
+    }
+
+    void write(std::string_view raw) {
+      buffer.append(raw);
+    }
+
+    void write(char raw) {
+      buffer.push_back(raw);
+    }
+
+    void writeString(std::string_view value) {
+      static constexpr char hex[] = "0123456789abcdef";
+
+      buffer.push_back('"');
+      auto run = value.begin();
+      for (auto it = value.begin(); it != value.end(); ++it) {
+        auto const c = static_cast<unsigned char>(*it);
+        if (c >= 0x20 && c != '"' && c != '\\') { continue; }
+
+        buffer.append(run, it);
+        run = it + 1;
+        switch (c) {
+          case '"': buffer.append("\\\""); break;
+          case '\\': buffer.append("\\\\"); break;
+          case '\n': buffer.append("\\n"); break;
+          case '\r': buffer.append("\\r"); break;
+          case '\t': buffer.append("\\t"); break;
+          default:
+            buffer.append("\\u00");
+            buffer.push_back(hex[c >> 4]);
+            buffer.push_back(hex[c & 0xf]);
+        }
+      }
+      buffer.append(run, value.end());
+      buffer.push_back('"');
+    }
+
+    template <typename Int, std::enable_if_t<std::is_integral_v<Int>, int> = 0>
+    void writeNumber(Int value) {
+      char digits[24];
+      auto const res = std::to_chars(std::begin(digits), std::end(digits), value);
+      buffer.append(digits, res.ptr);
+    }
+
+    // std::to_chars for floating point is not available in the toolchains we deploy with
+    void writeNumber(double value) {
+      if (!std::isfinite(value)) {
+        buffer.append("null");
+        return;
+      }
+      char digits[32];
+      auto const length = std::snprintf(digits, sizeof(digits), "%.9g", value);
+      buffer.append(digits, gsl::narrow<std::size_t>(length));
+    }
 };
 
-template <typename Res>
-void writeData(Res *res, json_literal value) {
-  res->write(value.raw);
+inline void writeData(JsonWriter *out, char const *value) {
+  if (value) {
+    out->writeString(value);
+  } else {
+    out->write("null");
+  }
 }
 
-template <typename Res>
-void writeData(Res *res, char const *value) {
-  res->write("\"");
-  res->write(value);
-  res->write("\"");
+template <typename Bool, std::enable_if_t<std::is_same_v<Bool, bool>, int> = 0>
+void writeData(JsonWriter *out, Bool value) {
+  out->write(value ? "true" : "false");
 }
 
-template <typename Res, typename Bool, std::enable_if_t<std::is_same_v<Bool, bool>, int> = 0>
-void writeData(Res *res, Bool value) {
-  res->write(value ? "true" : "false");
+template <typename T, std::enable_if_t<std::is_arithmetic_v<T>, int> = 0, std::enable_if_t<!std::is_same_v<T, bool>, int> = 0>
+void writeData(JsonWriter *out, T value) {
+  out->writeNumber(value);
 }
 
-template <typename Res, typename T, std::enable_if_t<std::is_arithmetic_v<T>, int> = 0, std::enable_if_t<!std::is_same_v<T, bool>, int> = 0>
-void writeData(Res *res, T value) {
-  res->write(std::to_string(value));
+inline void writeData(JsonWriter *out, GEnumValue const & value) {
+  out->write("{\"value\":");
+  writeData(out, value.value);
+  out->write(",\"name\":");
+  writeData(out, value.value_name);
+  out->write(",\"nick\":");
+  writeData(out, value.value_nick);
+  out->write('}');
 }
 
-template <typename Res, typename T, int n>
-void writeData(Res *res, gsl::span<T, n> values) {
-  res->write("[");
-  for (auto& value : values) {
-    writeData(res, value);
-    res->write(",");
-  }
-  res->write("]");
+inline void writeData(JsonWriter *out, GFlagsValue const & value) {
+  out->write("{\"value\":");
+  writeData(out, value.value);
+  out->write(",\"name\":");
+  writeData(out, value.value_name);
+  out->write(",\"nick\":");
+  writeData(out, value.value_nick);
+  out->write('}');
 }
 
-template <typename Res, typename T, typename U, int n>
-void writeData(Res *res, std::pair<gsl::span<T, n>, U (*)(T&)> transformThunk) {
-  auto& [values, f] = transformThunk;
-  res->write("[");
+template <typename T>
+void writeData(JsonWriter *out, gsl::span<T> values) {
+  out->write('[');
   if (!values.empty()) {
-    writeData(res, f(values[0]));
+    writeData(out, values[0]);
     for (auto& value : values.subspan(1)) {
-      res->write(",");
-      writeData(res, f(value));
+      out->write(',');
+      writeData(out, value);
     }
   }
-  res->write("]");
+  out->write(']');
 }
 
-template <typename Res, typename T>
-void writeField(Res *res, char const *field, T value) {
-  res->write(",\"");
-  res->write(field);
-  res->write("\":");
-  writeData(res, value);
+template <typename T>
+void writeField(JsonWriter *out, char const *field, T value) {
+  out->write(",\"");
+  out->write(field);
+  out->write("\":");
+  writeData(out, value);
 }
 
-template <typename Res, GLib::ref_t ref, GLib::unref_t unref>
-void writeProperty(const char *starter, Res *res, GLib::Object<ref, unref>& object, GParamSpec *property) {
-  if (G_IS_PARAM_SPEC_OBJECT(property)) { return; }
-
-  res->write(starter);
-
-  res->write("{\"type\":");
-  writeData(res, G_PARAM_SPEC_TYPE_NAME(property));
-
-  writeField(res, "name", g_param_spec_get_name(property));
-  writeField(res, "nick", g_param_spec_get_nick(property));
-  writeField(res, "blurb", g_param_spec_get_blurb(property));
-
-  GLib::Property value = object[g_param_spec_get_name(property)];
-
-  if (G_IS_PARAM_SPEC_BOOLEAN(property)) {
-    auto boolProperty = reinterpret_cast<GParamSpecBoolean*>(property);
-    writeField(res, "value", value.template get<bool>());
-    writeField(res, "default_value", bool(boolProperty->default_value));
-  } else if (G_IS_PARAM_SPEC_INT(property)) {
-    auto intProperty = reinterpret_cast<GParamSpecInt*>(property);
-    writeField(res, "value", value.template get<int>());
-    writeField(res, "minimum", intProperty->minimum);
-    writeField(res, "maximum", intProperty->maximum);
-    writeField(res, "default_value", intProperty->default_value);
-  } else if (G_IS_PARAM_SPEC_UINT(property)) {
-    auto uintProperty = reinterpret_cast<GParamSpecUInt*>(property);
-    writeField(res, "value", value.template get<guint>());
-    writeField(res, "minimum", uintProperty->minimum);
-    writeField(res, "maximum", uintProperty->maximum);
-    writeField(res, "default_value", uintProperty->default_value);
-  } else if (G_IS_PARAM_SPEC_FLOAT(property)) {
-    auto floatProperty = reinterpret_cast<GParamSpecFloat*>(property);
-    writeField(res, "value", value.template get<float>());
-    writeField(res, "minimum", floatProperty->minimum);
-    writeField(res, "maximum", floatProperty->maximum);
-    writeField(res, "default_value", floatProperty->default_value);
-    writeField(res, "epsilon", floatProperty->epsilon);
-  } else if (G_IS_PARAM_SPEC_ENUM(property)) {
-    auto enumProperty = reinterpret_cast<GParamSpecEnum*>(property);
-    auto g_value = value.g_value(G_PARAM_SPEC_VALUE_TYPE(property));
-    writeField(res, "value", g_value_get_enum(&g_value));
-    writeField(res, "minimum", enumProperty->enum_class->minimum);
-    writeField(res, "maximum", enumProperty->enum_class->maximum);
-    writeField
-      ( res
-      , "values"
-      , std::pair<gsl::span<GEnumValue>, json_literal (*)(GEnumValue&)>
-        { gsl::span{enumProperty->enum_class->values, gsl::narrow<int>(enumProperty->enum_class->n_values)}
-        , [] (auto enumValue) {
-            return json_literal{"{\"value\":" + std::to_string(enumValue.value) + ",\"name\":\"" + enumValue.value_name + "\",\"nick\":\"" + enumValue.value_nick + "\"}"};
+// Thrown for request bodies that cannot be applied, reported to the client as 400 Bad Request
+struct bad_request : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// Single-pass JSON parser over a complete text. Values are views into the text, so it must outlive them.
+class JsonParser {
+  public:
+    struct Value {
+      enum class Kind { null, boolean, number, string, object, array };
+
+      Kind kind;
+      std::string_view raw; // contents of a string without the quotes, otherwise the text of the value
+      bool escaped = false; // whether a string contains escape sequences, so raw cannot be used as is
+
+      std::string text() const {
+        if (!escaped) { return std::string{raw}; }
+
+        auto result = std::string{};
+        result.reserve(raw.size());
+        for (auto it = raw.begin(); it != raw.end(); ++it) {
+          if (*it != '\\') {
+            result.push_back(*it);
+            continue;
+          }
+          switch (*++it) {
+            case 'b': result.push_back('\b'); break;
+            case 'f': result.push_back('\f'); break;
+            case 'n': result.push_back('\n'); break;
+            case 'r': result.push_back('\r'); break;
+            case 't': result.push_back('\t'); break;
+            case 'u': {
+              auto code_point = hex4(it + 1);
+              it += 4;
+              if (code_point >= 0xd800 && code_point < 0xdc00 && raw.end() - it > 6 && it[1] == '\\' && it[2] == 'u') {
+                code_point = 0x10000 + ((code_point - 0xd800) << 10) + (hex4(it + 3) - 0xdc00);
+                it += 6;
+              }
+              appendUtf8(result, code_point);
+              break;
+            }
+            default: result.push_back(*it); break;
           }
         }
-      );
-    writeField(res, "default_value", enumProperty->default_value);
-  } else if (G_IS_PARAM_SPEC_FLAGS(property)) {
-    auto flagsProperty = reinterpret_cast<GParamSpecFlags*>(property);
-    auto g_value = value.g_value(G_PARAM_SPEC_VALUE_TYPE(property));
-    writeField(res, "value", g_value_get_flags(&g_value));
-    writeField(res, "mask", flagsProperty->flags_class->mask);
-    writeField
-      ( res
-      , "values"
-      , std::pair<gsl::span<GFlagsValue>, json_literal (*)(GFlagsValue&)>
-        { gsl::span{flagsProperty->flags_class->values, gsl::narrow<int>(flagsProperty->flags_class->n_values)}
-        , [] (auto flagsValue) {
-            return json_literal{"{\"value\":" + std::to_string(flagsValue.value) + ",\"name\":\"" + flagsValue.value_name + "\",\"nick\":\"" + flagsValue.value_nick + "\"}"};
+        return result;
+      }
+
+      private:
+        static std::uint32_t hex4(std::string_view::const_iterator digits) {
+          auto value = std::uint32_t{};
+          std::from_chars(digits, digits + 4, value, 16);
+          return value;
+        }
+
+        static void appendUtf8(std::string& out, std::uint32_t code_point) {
+          if (code_point < 0x80) {
+            out.push_back(char(code_point));
+          } else if (code_point < 0x800) {
+            out.push_back(char(0xc0 | (code_point >> 6)));
+            out.push_back(char(0x80 | (code_point & 0x3f)));
+          } else if (code_point < 0x10000) {
+            out.push_back(char(0xe0 | (code_point >> 12)));
+            out.push_back(char(0x80 | ((code_point >> 6) & 0x3f)));
+            out.push_back(char(0x80 | (code_point & 0x3f)));
+          } else {
+            out.push_back(char(0xf0 | (code_point >> 18)));
+            out.push_back(char(0x80 | ((code_point >> 12) & 0x3f)));
+            out.push_back(char(0x80 | ((code_point >> 6) & 0x3f)));
+            out.push_back(char(0x80 | (code_point & 0x3f)));
           }
         }
-      );
-    writeField(res, "default_value", flagsProperty->default_value);
-  } else if (G_IS_PARAM_SPEC_STRING(property)) {
-    auto stringProperty = reinterpret_cast<GParamSpecString*>(property);
-    writeField(res, "value", value.template get<const char *>());
-    writeField(res, "default_value", stringProperty->default_value);
-  } else {
-    std::cerr << "Unknown property " << g_param_spec_get_name(property) << " of type: " << G_PARAM_SPEC_TYPE_NAME(property) << '\n';
-  }
+    };
 
-  res->write("}");
-}
+  private:
+    static constexpr auto max_depth = 16;
 
-auto remove_quotes(std::string_view str) {
-  return str.substr(str.find('"') + 1, str.rfind('"') - str.find('"') - 1);
-}
+    std::string_view json;
+    std::size_t pos = 0;
+    int depth = 0;
 
-auto parse_json_object(std::string_view json) {
-  auto fields = std::vector<std::pair<std::string_view, std::string_view>>{};
-  try {
-    json = json.substr(json.find_first_not_of(" \t\n"));
+    [[noreturn]] void fail(char const *expected) const {
+      throw bad_request{"Malformed JSON at offset "s + std::to_string(pos) + ": expected " + expected};
+    }
 
-    if (json[0] != '{') { throw std::out_of_range{""}; }
+    void skipWhitespace() {
+      while (pos < json.size() && (json[pos] == ' ' || json[pos] == '\t' || json[pos] == '\n' || json[pos] == '\r')) { ++pos; }
+    }
 
-    while (json[0] != '}') {
-      json = json.substr(1);
-  
-      auto const field_name_end = json.find(':');
-      auto const field_name_quoted = json.substr(0, field_name_end);
-      auto const field_name = remove_quotes(field_name_quoted);
-      json = json.substr(field_name_end + 1);
+    void expect(char c, char const *expected) {
+      skipWhitespace();
+      if (pos >= json.size() || json[pos] != c) { fail(expected); }
+      ++pos;
+    }
 
-      json = json.substr(json.find_first_not_of(" \t\n"));
-  
-      auto const value_end = json[0] == '"' ? json.find('"', 1) + 1 : json.find_first_of(",}");
-      auto const value = json.substr(0, value_end);
-      json = json.substr(value_end);
+    bool consume(char c) {
+      skipWhitespace();
+      if (pos < json.size() && json[pos] == c) {
+        ++pos;
+        return true;
+      }
+      return false;
+    }
 
-      json = json.substr(json.find_first_not_of(" \t\n"));
+    void literal(std::string_view word) {
+      if (json.substr(pos, word.size()) != word) { fail("a value"); }
+      pos += word.size();
+    }
+
+    static bool isHex(char c) {
+      return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+    }
+
+    Value string() {
+      auto value = Value{Value::Kind::string};
+      auto const start = ++pos;
+      while (true) {
+        if (pos >= json.size()) { fail("closing quote"); }
+        auto const c = json[pos];
+        if (c == '"') { break; }
+        if (static_cast<unsigned char>(c) < 0x20) { fail("escaped control character"); }
+        if (c == '\\') {
+          value.escaped = true;
+          if (++pos >= json.size()) { fail("escape sequence"); }
+          if (json[pos] == 'u') {
+            if (json.size() - pos < 5 || !std::all_of(json.begin() + pos + 1, json.begin() + pos + 5, isHex)) { fail("four hex digits"); }
+            pos += 4;
+          } else if (std::string_view{"\"\\/bfnrt"}.find(json[pos]) == std::string_view::npos) {
+            fail("escape sequence");
+          }
+        }
+        ++pos;
+      }
+      value.raw = json.substr(start, pos - start);
+      ++pos;
+      return value;
+    }
+
+    Value number() {
+      auto const start = pos;
+      auto const digits = [&] () {
+        auto const first = pos;
+        while (pos < json.size() && json[pos] >= '0' && json[pos] <= '9') { ++pos; }
+        if (pos == first) { fail("digit"); }
+      };
+      if (json[pos] == '-') { ++pos; }
+      digits();
+      if (pos < json.size() && json[pos] == '.') {
+        ++pos;
+        digits();
+      }
+      if (pos < json.size() && (json[pos] == 'e' || json[pos] == 'E')) {
+        ++pos;
+        if (pos < json.size() && (json[pos] == '+' || json[pos] == '-')) { ++pos; }
+        digits();
+      }
+      return Value{Value::Kind::number, json.substr(start, pos - start)};
+    }
+
+  public:
+    explicit JsonParser(std::string_view json) : json{json} {}
+
+    // Parses any value. Objects and arrays are validated and skipped, with raw spanning their whole text.
+    Value value() {
+      skipWhitespace();
+      if (pos >= json.size()) { fail("a value"); }
+
+      auto const start = pos;
+      switch (json[pos]) {
+        case '"':
+          return string();
+        case '{':
+          object([] (std::string_view, Value) {});
+          return Value{Value::Kind::object, json.substr(start, pos - start)};
+        case '[':
+          array([] (JsonParser& parser) { parser.value(); });
+          return Value{Value::Kind::array, json.substr(start, pos - start)};
+        case 't':
+          literal("true");
+          return Value{Value::Kind::boolean, json.substr(start, pos - start)};
+        case 'f':
+          literal("false");
+          return Value{Value::Kind::boolean, json.substr(start, pos - start)};
+        case 'n':
+          literal("null");
+          return Value{Value::Kind::null, json.substr(start, pos - start)};
+        default:
+          return number();
+      }
+    }
+
+    // Calls field(key, value) for each member of an object, in order
+    template <typename F>
+    void object(F&& field) {
+      expect('{', "'{'");
+      if (++depth > max_depth) { fail("less nesting"); }
+      if (!consume('}')) {
+        do {
+          skipWhitespace();
+          if (pos >= json.size() || json[pos] != '"') { fail("field name"); }
+          auto const key = string();
+          expect(':', "':'");
+          field(key.escaped ? std::string_view{} : key.raw, value());
+        } while (consume(','));
+        expect('}', "',' or '}'");
+      }
+      --depth;
+    }
+
+    // Calls element(parser) for each element of an array, which must consume exactly one value
+    template <typename F>
+    void array(F&& element) {
+      expect('[', "'['");
+      if (++depth > max_depth) { fail("less nesting"); }
+      if (!consume(']')) {
+        do {
+          element(*this);
+        } while (consume(','));
+        expect(']', "',' or ']'");
+      }
+      --depth;
+    }
 
-      fields.emplace_back(field_name, value);
+    char peek() {
+      skipWhitespace();
+      return pos < json.size() ? json[pos] : '\0';
     }
-  } catch (std::out_of_range const &) {
-    fields.clear();
+
+    void finish() {
+      skipWhitespace();
+      if (pos != json.size()) { fail("end of input"); }
+    }
+};
+
+// How to describe, serialize and parse the values of one fundamental type of property
+struct PropertyType {
+  GType (*fundamental)();
+  std::uint8_t tag; // identifies the type in the binary control protocol, never reused
+  void (*writeBounds)(JsonWriter *out, GParamSpec *property);
+  void (*writeValue)(JsonWriter *out, GValue const & value);
+  // g_value is already initialised to the value type of property
+  void (*parseValue)(GParamSpec *property, JsonParser::Value const & value, GValue& g_value);
+  // Little-endian and fixed size, except for strings; parseBinary consumes the value from the front of data
+  void (*writeBinary)(std::string& out, GValue const & value);
+  bool (*parseBinary)(std::string_view& data, GValue& g_value);
+};
+
+// Little-endian fields of the binary control protocol
+namespace Binary {
+  template <typename T>
+  void put(std::string& out, T value) {
+    static_assert(std::is_arithmetic_v<T>);
+    unsigned char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    if constexpr (G_BYTE_ORDER == G_BIG_ENDIAN) { std::reverse(std::begin(bytes), std::end(bytes)); }
+    out.append(reinterpret_cast<char const *>(bytes), sizeof(T));
+  }
+
+  // Takes a T off the front of data, or nothing if data is too short
+  template <typename T>
+  std::optional<T> take(std::string_view& data) {
+    static_assert(std::is_arithmetic_v<T>);
+    if (data.size() < sizeof(T)) { return std::nullopt; }
+    unsigned char bytes[sizeof(T)];
+    std::memcpy(bytes, data.data(), sizeof(T));
+    if constexpr (G_BYTE_ORDER == G_BIG_ENDIAN) { std::reverse(std::begin(bytes), std::end(bytes)); }
+    data.remove_prefix(sizeof(T));
+    auto value = T{};
+    std::memcpy(&value, bytes, sizeof(T));
+    return value;
+  }
+
+  // A string is its length as a u16 followed by that many bytes
+  inline void putString(std::string& out, std::string_view value) {
+    value = value.substr(0, std::numeric_limits<std::uint16_t>::max());
+    put(out, std::uint16_t(value.size()));
+    out.append(value);
+  }
+
+  inline std::optional<std::string_view> takeString(std::string_view& data) {
+    auto const size = take<std::uint16_t>(data);
+    if (!size || data.size() < *size) { return std::nullopt; }
+    auto const value = data.substr(0, *size);
+    data.remove_prefix(*size);
+    return value;
   }
-  return [fields] (auto field_name) {
-      return std::find_if(fields.begin(), fields.end(), [&] (auto& field) { return field.first == field_name; })->second;
-    };
 }
 
-template <typename Object>
-void parse_set_property(Object object, std::string_view json) {
-  auto const fields = parse_json_object(json);
+namespace PropertyTypes {
+  using Kind = JsonParser::Value::Kind;
+
+  template <GType type>
+  GType fundamental() {
+    return type;
+  }
 
-  auto const name = std::string{remove_quotes(fields("name"))};
-  auto const type = remove_quotes(fields("type"));
-  auto const value_s = fields("value");
+  inline bad_request invalid(GParamSpec *property, JsonParser::Value const & value) {
+    return bad_request{"Invalid "s + G_PARAM_SPEC_TYPE_NAME(property) + " for " + g_param_spec_get_name(property) + ": " + std::string{value.raw}};
+  }
 
-  auto property = object[name.c_str()];
+  template <typename T>
+  T parseNumber(GParamSpec *property, JsonParser::Value const & value) {
+    if (value.kind != Kind::number) { throw invalid(property, value); }
 
-  if (type == "GParamBoolean") {
-    if (value_s == "true") {
-      property = true;
-    } else if (value_s == "false") {
-      property = false;
+    if constexpr (std::is_floating_point_v<T>) {
+      // std::from_chars for floating point is not available in the toolchains we deploy with
+      char digits[32] = {};
+      if (value.raw.size() >= sizeof(digits)) { throw invalid(property, value); }
+      std::copy(value.raw.begin(), value.raw.end(), digits);
+      return T(std::strtod(digits, nullptr));
     } else {
-      std::cerr << "Invalid bool: " << value_s << '\n';
+      auto result = T{};
+      auto const res = std::from_chars(value.raw.begin(), value.raw.end(), result);
+      if (res.ec != std::errc{} || res.ptr != value.raw.end()) { throw invalid(property, value); }
+      return result;
     }
-  } else if (type == "GParamInt") {
-    auto value = gint{};
-    auto res = std::from_chars(value_s.begin(), value_s.end(), value);
+  }
 
-    if (res.ptr == value_s.end()) {
-      property = value;
-    } else {
-      std::cerr << "Invalid int: " << value_s << '\n';
+  struct Boolean {
+    static void writeBounds(JsonWriter *out, GParamSpec *property) {
+      writeField(out, "default_value", bool(G_PARAM_SPEC_BOOLEAN(property)->default_value));
     }
-  } else if (type == "GParamUInt") {
-    auto value = guint{};
-    auto res = std::from_chars(value_s.begin(), value_s.end(), value);
 
-    if (res.ptr == value_s.end()) {
-      property = value;
-    } else {
-      std::cerr << "Invalid int: " << value_s << '\n';
-    }
-  } else if (type == "GParamFloat") {
-    try {
-      property = std::stof(std::string{value_s});
-    } catch (std::invalid_argument const &) {
-      std::cerr << "Invalid float: " << value_s << '\n';
-    } catch (std::out_of_range const &) {
-      std::cerr << "Invalid float: " << value_s << '\n';
-    }
-  } else if (type == "GParamEnum") {
-    GValue g_value = G_VALUE_INIT;
-    g_value_init(&g_value, G_PARAM_SPEC_VALUE_TYPE(object.property(name.c_str())));
-
-    auto value = gint{};
-    auto res = std::from_chars(value_s.begin(), value_s.end(), value);
-
-    if (res.ptr == value_s.end()) {
-      g_value_set_enum(&g_value, value);
-      property = g_value;
-    } else {
-      std::cerr << "Invalid enum: " << value_s << '\n';
+    static void writeValue(JsonWriter *out, GValue const & value) {
+      writeData(out, bool(g_value_get_boolean(&value)));
     }
-  } else if (type == "GParamFlags") {
-    GValue g_value = G_VALUE_INIT;
-    g_value_init(&g_value, G_PARAM_SPEC_VALUE_TYPE(object.property(name.c_str())));
 
-    auto value = guint{};
-    auto res = std::from_chars(value_s.begin(), value_s.end(), value);
+    static void parseValue(GParamSpec *property, JsonParser::Value const & value, GValue& g_value) {
+      if (value.kind != Kind::boolean) { throw invalid(property, value); }
+      g_value_set_boolean(&g_value, value.raw == "true");
+    }
 
-    if (res.ptr == value_s.end()) {
-      g_value_set_flags(&g_value, value);
-      property = g_value;
-    } else {
-      std::cerr << "Invalid flags: " << value_s << '\n';
+    static void writeBinary(std::string& out, GValue const & value) {
+      Binary::put(out, std::uint8_t(g_value_get_boolean(&value) ? 1 : 0));
     }
-  } else if (type == "GParamString") {
-    property = remove_quotes(value_s);
-  } else {
-    std::cerr << "Unrecognised type: " << type << '\n';
-  }
-}
 
-int main(int argc, char **argv) {
-  // init
-  gst_init (&argc, &argv);
+    static bool parseBinary(std::string_view& data, GValue& g_value) {
+      auto const value = Binary::take<std::uint8_t>(data);
+      if (!value || *value > 1) { return false; }
+      g_value_set_boolean(&g_value, *value);
+      return true;
+    }
+  };
 
-  auto loop = std::unique_ptr<GMainLoop, void (*)(GMainLoop*)>{g_main_loop_new(nullptr, FALSE), g_main_loop_unref};
+  template <typename T, typename Spec, T (*get)(GValue const *), void (*set)(GValue *, T)>
+  struct Number {
+    static void writeBounds(JsonWriter *out, GParamSpec *property) {
+      auto const spec = reinterpret_cast<Spec*>(property);
+      writeField(out, "minimum", spec->minimum);
+      writeField(out, "maximum", spec->maximum);
+      writeField(out, "default_value", spec->default_value);
+      if constexpr (std::is_floating_point_v<T>) {
+        writeField(out, "epsilon", spec->epsilon);
+      }
+    }
 
-  // create pipeline
-  auto pipeline = Gst::Pipeline{"pipeline"};
-
-  // create elements
-  auto rpicamsrc = Gst::Element{"rpicamsrc", "rpicamsrc"};
-  rpicamsrc["bitrate"] = 1000000;
-  rpicamsrc["keyframe-interval"] = 30;
-  rpicamsrc["preview"] = false;
-
-  auto rtph264pay = Gst::Element{"rtph264pay", "rtph264pay"};
-
-  auto udpsink = Gst::Element{"udpsink", "udpsink"};
-  udpsink["host"] = "192.168.16.61";
-  udpsink["port"] = 5000;
-
-  /* must add elements to pipeline before linking them */
-  pipeline.add(rpicamsrc);
-  pipeline.add(rtph264pay);
-  pipeline.add(udpsink);
-
-  auto filter = gst_caps_new_simple
-    ( "video/x-h264"
-    //, "format", G_TYPE_STRING, "I420"
-    , "width", G_TYPE_INT, 1280
-    , "height", G_TYPE_INT, 720
-    , "framerate", GST_TYPE_FRACTION, 30, 1
-    , NULL
-    );
+    static void writeValue(JsonWriter *out, GValue const & value) {
+      writeData(out, get(&value));
+    }
 
-  /* link */
-  Gst::Element::link_filtered(rpicamsrc, rtph264pay, filter);
-  Gst::Element::link(rtph264pay, udpsink);
+    static void parseValue(GParamSpec *property, JsonParser::Value const & value, GValue& g_value) {
+      set(&g_value, parseNumber<T>(property, value));
+    }
 
-  pipeline.set_state(GST_STATE_PLAYING);
+    static void writeBinary(std::string& out, GValue const & value) {
+      Binary::put(out, get(&value));
+    }
 
-  auto web_thread = std::thread
-    ( [&] () {
-        auto app = uWS::App{};
-        app.get
-          ( "/properties"
-          , [&] (auto *res, auto *req) {
-              res->cork
-                ( [&] () {
-                    res->writeHeader("Access-Control-Allow-Origin", "*");
+    static bool parseBinary(std::string_view& data, GValue& g_value) {
+      auto const value = Binary::take<T>(data);
+      if (!value) { return false; }
+      set(&g_value, *value);
+      return true;
+    }
+  };
 
-                    auto properties = rpicamsrc.properties();
+  // Also accepts the nick or name of a value as a string
+  struct Enum {
+    static void writeBounds(JsonWriter *out, GParamSpec *property) {
+      auto const spec = G_PARAM_SPEC_ENUM(property);
+      writeField(out, "minimum", spec->enum_class->minimum);
+      writeField(out, "maximum", spec->enum_class->maximum);
+      writeField(out, "values", gsl::span<GEnumValue>{spec->enum_class->values, gsl::narrow<int>(spec->enum_class->n_values)});
+      writeField(out, "default_value", spec->default_value);
+    }
 
-                    if (properties.empty()) {
-                      res->write("[]");
-                    } else {
-                      writeProperty("[", res, rpicamsrc, properties[0]);
-                      for (auto& property : properties.subspan(1)) {
-                        writeProperty(",", res, rpicamsrc, property);
-                      }
-                      res->write("]");
-                    }
-                    res->end();
-                  }
-                );
-            }
-          );
-        app.options
-          ( "/set_property"
-          , [] (auto *res, auto *req) {
-              res->writeHeader("Access-Control-Allow-Headers", "*");
-              res->writeHeader("Access-Control-Allow-Methods", "*");
-              res->writeHeader("Access-Control-Allow-Origin", "*");
-              res->end();
-            }
-          );
-        app.post
-          ( "/set_property"
-          , [&] (auto *res, auto *req) mutable {
-              res->writeHeader("Access-Control-Allow-Origin", "*");
-              res->onData
-                ( [&] (std::string_view data, bool fin) {
-                    parse_set_property(rpicamsrc, data);
-                  }
-                );
-              res->writeStatus("204 No Content");
-              res->end();
-            }
-          );
-        app.listen(9001, [](auto *listenSocket) {
-          if (listenSocket) {
-            std::cout << "Listening for connections..." << std::endl;
-          }
-        });
-        app.run();
+    static void writeValue(JsonWriter *out, GValue const & value) {
+      writeData(out, g_value_get_enum(&value));
+    }
+
+    static void parseValue(GParamSpec *property, JsonParser::Value const & value, GValue& g_value) {
+      if (value.kind == Kind::string) {
+        auto const enum_class = G_PARAM_SPEC_ENUM(property)->enum_class;
+        auto const text = value.text();
+        auto enum_value = g_enum_get_value_by_nick(enum_class, text.c_str());
+        if (!enum_value) { enum_value = g_enum_get_value_by_name(enum_class, text.c_str()); }
+        if (!enum_value) { throw invalid(property, value); }
+        g_value_set_enum(&g_value, enum_value->value);
+      } else {
+        g_value_set_enum(&g_value, parseNumber<gint>(property, value));
       }
-    );
+    }
 
-  // Iterate
-  g_print("Running...\n");
-  g_main_loop_run(loop.get());
+    static void writeBinary(std::string& out, GValue const & value) {
+      Binary::put(out, gint32(g_value_get_enum(&value)));
+    }
+
+    static bool parseBinary(std::string_view& data, GValue& g_value) {
+      auto const value = Binary::take<gint32>(data);
+      if (!value) { return false; }
+      g_value_set_enum(&g_value, *value);
+      return true;
+    }
+  };
+
+  struct Flags {
+    static void writeBounds(JsonWriter *out, GParamSpec *property) {
+      auto const spec = G_PARAM_SPEC_FLAGS(property);
+      writeField(out, "mask", spec->flags_class->mask);
+      writeField(out, "values", gsl::span<GFlagsValue>{spec->flags_class->values, gsl::narrow<int>(spec->flags_class->n_values)});
+      writeField(out, "default_value", spec->default_value);
+    }
+
+    static void writeValue(JsonWriter *out, GValue const & value) {
+      writeData(out, g_value_get_flags(&value));
+    }
+
+    static void parseValue(GParamSpec *property, JsonParser::Value const & value, GValue& g_value) {
+      g_value_set_flags(&g_value, parseNumber<guint>(property, value));
+    }
+
+    static void writeBinary(std::string& out, GValue const & value) {
+      Binary::put(out, guint32(g_value_get_flags(&value)));
+    }
+
+    static bool parseBinary(std::string_view& data, GValue& g_value) {
+      auto const value = Binary::take<guint32>(data);
+      if (!value) { return false; }
+      g_value_set_flags(&g_value, *value);
+      return true;
+    }
+  };
+
+  struct String {
+    static void writeBounds(JsonWriter *out, GParamSpec *property) {
+      writeField(out, "default_value", G_PARAM_SPEC_STRING(property)->default_value);
+    }
+
+    static void writeValue(JsonWriter *out, GValue const & value) {
+      writeData(out, g_value_get_string(&value));
+    }
+
+    static void parseValue(GParamSpec *property, JsonParser::Value const & value, GValue& g_value) {
+      if (value.kind == Kind::null) { return; }
+      if (value.kind != Kind::string) { throw invalid(property, value); }
+      g_value_set_string(&g_value, value.text().c_str());
+    }
+
+    // A null string is written as an empty one
+    static void writeBinary(std::string& out, GValue const & value) {
+      auto const string = g_value_get_string(&value);
+      Binary::putString(out, string ? string : "");
+    }
+
+    static bool parseBinary(std::string_view& data, GValue& g_value) {
+      auto const value = Binary::takeString(data);
+      if (!value) { return false; }
+      g_value_set_string(&g_value, std::string{*value}.c_str());
+      return true;
+    }
+  };
+
+  // Written as [numerator, denominator], also accepts "numerator/denominator"
+  struct Fraction {
+    struct fraction {
+      gint numerator;
+      gint denominator;
+    };
+
+    friend void writeData(JsonWriter *out, fraction value) {
+      out->write('[');
+      writeData(out, value.numerator);
+      out->write(',');
+      writeData(out, value.denominator);
+      out->write(']');
+    }
+
+    static void writeBounds(JsonWriter *out, GParamSpec *property) {
+      auto const spec = GST_PARAM_SPEC_FRACTION(property);
+      writeField(out, "minimum", fraction{spec->min_num, spec->min_den});
+      writeField(out, "maximum", fraction{spec->max_num, spec->max_den});
+      writeField(out, "default_value", fraction{spec->def_num, spec->def_den});
+    }
+
+    static void writeValue(JsonWriter *out, GValue const & value) {
+      writeData(out, fraction{gst_value_get_fraction_numerator(&value), gst_value_get_fraction_denominator(&value)});
+    }
+
+    static void parseValue(GParamSpec *property, JsonParser::Value const & value, GValue& g_value) {
+      auto parts = std::array<gint, 2>{};
+      auto count = std::size_t{};
+
+      if (value.kind == Kind::array) {
+        auto parser = JsonParser{value.raw};
+        parser.array
+          ( [&] (JsonParser& parser) {
+              auto const part = parser.value();
+              if (count == parts.size()) { throw invalid(property, value); }
+              parts[count++] = parseNumber<gint>(property, part);
+            }
+          );
+      } else if (value.kind == Kind::string && !value.escaped) {
+        auto const slash = value.raw.find('/');
+        if (slash == std::string_view::npos) { throw invalid(property, value); }
+        parts[0] = parseNumber<gint>(property, JsonParser::Value{Kind::number, value.raw.substr(0, slash)});
+        parts[1] = parseNumber<gint>(property, JsonParser::Value{Kind::number, value.raw.substr(slash + 1)});
+        count = 2;
+      }
+
+      if (count != parts.size() || parts[1] == 0) { throw invalid(property, value); }
+      gst_value_set_fraction(&g_value, parts[0], parts[1]);
+    }
+
+    // Numerator then denominator, both i32
+    static void writeBinary(std::string& out, GValue const & value) {
+      Binary::put(out, gint32(gst_value_get_fraction_numerator(&value)));
+      Binary::put(out, gint32(gst_value_get_fraction_denominator(&value)));
+    }
+
+    static bool parseBinary(std::string_view& data, GValue& g_value) {
+      auto const numerator = Binary::take<gint32>(data);
+      auto const denominator = Binary::take<gint32>(data);
+      if (!numerator || !denominator || *denominator == 0) { return false; }
+      gst_value_set_fraction(&g_value, *numerator, *denominator);
+      return true;
+    }
+  };
+
+  template <std::uint8_t tag, GType (*fundamental)(), typename Traits>
+  constexpr PropertyType make() {
+    return PropertyType{fundamental, tag, &Traits::writeBounds, &Traits::writeValue, &Traits::parseValue, &Traits::writeBinary, &Traits::parseBinary};
+  }
+}
+
+// Supporting another type of property only needs an entry here, with a tag of its own
+constexpr PropertyType property_types[] =
+  { PropertyTypes::make<1, &PropertyTypes::fundamental<G_TYPE_BOOLEAN>, PropertyTypes::Boolean>()
+  , PropertyTypes::make<2, &PropertyTypes::fundamental<G_TYPE_INT>, PropertyTypes::Number<gint, GParamSpecInt, &g_value_get_int, &g_value_set_int>>()
+  , PropertyTypes::make<3, &PropertyTypes::fundamental<G_TYPE_UINT>, PropertyTypes::Number<guint, GParamSpecUInt, &g_value_get_uint, &g_value_set_uint>>()
+  , PropertyTypes::make<4, &PropertyTypes::fundamental<G_TYPE_INT64>, PropertyTypes::Number<gint64, GParamSpecInt64, &g_value_get_int64, &g_value_set_int64>>()
+  , PropertyTypes::make<5, &PropertyTypes::fundamental<G_TYPE_UINT64>, PropertyTypes::Number<guint64, GParamSpecUInt64, &g_value_get_uint64, &g_value_set_uint64>>()
+  , PropertyTypes::make<6, &PropertyTypes::fundamental<G_TYPE_FLOAT>, PropertyTypes::Number<gfloat, GParamSpecFloat, &g_value_get_float, &g_value_set_float>>()
+  , PropertyTypes::make<7, &PropertyTypes::fundamental<G_TYPE_DOUBLE>, PropertyTypes::Number<gdouble, GParamSpecDouble, &g_value_get_double, &g_value_set_double>>()
+  , PropertyTypes::make<8, &PropertyTypes::fundamental<G_TYPE_ENUM>, PropertyTypes::Enum>()
+  , PropertyTypes::make<9, &PropertyTypes::fundamental<G_TYPE_FLAGS>, PropertyTypes::Flags>()
+  , PropertyTypes::make<10, &PropertyTypes::fundamental<G_TYPE_STRING>, PropertyTypes::String>()
+  , PropertyTypes::make<11, &gst_fraction_get_type, PropertyTypes::Fraction>()
+  };
+
+inline PropertyType const * find_property_type(GParamSpec *property) {
+  for (auto& type : property_types) {
+    if (g_type_is_a(G_PARAM_SPEC_VALUE_TYPE(property), type.fundamental())) {
+      return &type;
+    }
+  }
+  return nullptr;
+}
+
+// The metadata of a property (type, nick, blurb, bounds, enum tables) is fixed for the lifetime of the class,
+// so it is rendered once up front and only the current value is spliced in per request.
+class PropertiesSchema {
+  public:
+    struct Entry {
+      GParamSpec *property;
+      PropertyType const *type; // null for properties of an unsupported type, which are listed without a value
+      std::string prefix;
+      std::string suffix;
+      mutable GLib::Property handle; // only read from the web thread
+
+      bool writable() const {
+        return (property->flags & G_PARAM_WRITABLE) && !(property->flags & G_PARAM_CONSTRUCT_ONLY);
+      }
+
+      // Throws bad_request if value does not fit the property
+      GValue parse(JsonParser::Value const & value) const {
+        GValue g_value = G_VALUE_INIT;
+        g_value_init(&g_value, G_PARAM_SPEC_VALUE_TYPE(property));
+        try {
+          type->parseValue(property, value, g_value);
+        } catch (...) {
+          g_value_unset(&g_value);
+          throw;
+        }
+        if (g_param_value_validate(property, &g_value)) {
+          g_value_unset(&g_value);
+          throw bad_request{"Value out of range for "s + g_param_spec_get_name(property) + ": " + std::string{value.raw}};
+        }
+        return g_value;
+      }
+
+      // As parse, for a value in the binary control protocol, which is consumed from the front of data
+      GValue parse(std::string_view& data) const {
+        GValue g_value = G_VALUE_INIT;
+        g_value_init(&g_value, G_PARAM_SPEC_VALUE_TYPE(property));
+        if (!type->parseBinary(data, g_value)) {
+          g_value_unset(&g_value);
+          throw bad_request{"Invalid "s + G_PARAM_SPEC_TYPE_NAME(property) + " for " + g_param_spec_get_name(property)};
+        }
+        if (g_param_value_validate(property, &g_value)) {
+          g_value_unset(&g_value);
+          throw bad_request{"Value out of range for "s + g_param_spec_get_name(property)};
+        }
+        return g_value;
+      }
+    };
+
+  private:
+    std::vector<Entry> entries;
+    std::unordered_map<std::string_view, std::size_t> index;
+
+    static void writeHeader(JsonWriter *out, GParamSpec *property) {
+      out->write("{\"type\":");
+      writeData(out, G_PARAM_SPEC_TYPE_NAME(property));
+
+      writeField(out, "name", g_param_spec_get_name(property));
+      writeField(out, "nick", g_param_spec_get_nick(property));
+      writeField(out, "blurb", g_param_spec_get_blurb(property));
+    }
+
+    static void writeValue(JsonWriter *out, Entry const & entry) {
+      if (!entry.type) { return; }
+      entry.type->writeValue(out, entry.handle.value());
+    }
+
+  public:
+    template <GLib::ref_t ref, GLib::unref_t unref>
+    PropertiesSchema(GLib::Object<ref, unref>& object) {
+      for (auto& property : object.properties()) {
+        if (G_IS_PARAM_SPEC_OBJECT(property)) { continue; }
+
+        auto const type = find_property_type(property);
+        if (!type) {
+          std::cerr << "Unknown property " << g_param_spec_get_name(property) << " of type: " << G_PARAM_SPEC_TYPE_NAME(property) << '\n';
+        }
+
+        index.emplace(g_param_spec_get_name(property), entries.size());
+        auto& entry = entries.emplace_back(Entry{property, type, entries.empty() ? "[" : ",", "", object[property]});
+
+        auto prefix = JsonWriter{1024};
+        writeHeader(&prefix, property);
+
+        auto suffix = JsonWriter{1024};
+        if (type) {
+          prefix.write(",\"value\":");
+          type->writeBounds(&suffix, property);
+        }
+        suffix.write('}');
+
+        entry.prefix += prefix.view();
+        entry.suffix = suffix.release();
+      }
+    }
+
+    Entry const * find(std::string_view name) const {
+      auto const it = index.find(name);
+      return it == index.end() ? nullptr : &entries[it->second];
+    }
+
+    // The ids of the binary control protocol are positions in the schema, which is fixed for the lifetime of the process
+    std::size_t size() const {
+      return entries.size();
+    }
+
+    Entry const * at(std::size_t id) const {
+      return id < entries.size() ? &entries[id] : nullptr;
+    }
+
+    std::size_t id(Entry const & entry) const {
+      return std::size_t(&entry - entries.data());
+    }
+
+    // Only to be called from the web thread
+    void write(JsonWriter *out) const {
+      if (entries.empty()) {
+        out->write("[]");
+        return;
+      }
+
+      for (auto& entry : entries) {
+        out->write(entry.prefix);
+        writeValue(out, entry);
+        out->write(entry.suffix);
+      }
+      out->write(']');
+    }
+
+    // Writes the current values of the writable properties include(name) accepts as {"name":value,...}, as /set_properties takes them.
+    // Only to be called from the web thread.
+    template <typename F>
+    void writeValues(JsonWriter *out, F&& include) const {
+      out->write('{');
+      auto first = true;
+      for (auto& entry : entries) {
+        auto const name = g_param_spec_get_name(entry.property);
+        if (!entry.type || !entry.writable() || !include(std::string_view{name})) { continue; }
+
+        if (!first) { out->write(','); }
+        out->writeString(name);
+        out->write(':');
+        writeValue(out, entry);
+        first = false;
+      }
+      out->write('}');
+    }
+
+    // Writes {"name":...,"value":...} for a single property, as pushed to WebSocket clients when it changes.
+    // Safe to call from any thread.
+    bool writeChange(JsonWriter *out, GParamSpec *property) const {
+      auto const entry = find(g_param_spec_get_name(property));
+      if (!entry || !entry->type) { return false; }
+
+      out->write("{\"name\":");
+      writeData(out, g_param_spec_get_name(property));
+      out->write(",\"value\":");
+      entry->type->writeValue(out, *entry->handle.copy().get());
+      out->write('}');
+      return true;
+    }
+};
+
+// Collects a request body delivered in chunks, up to limit bytes
+class RequestBody {
+  private:
+    static constexpr auto limit = std::size_t{16 * 1024};
+
+    std::string buffer;
+    bool too_large = false;
+
+  public:
+    // Returns the whole body once the last chunk has arrived.
+    // A body that arrives in one chunk is returned without being copied, if it is within the limit.
+    std::optional<std::string_view> append(std::string_view data, bool fin) {
+      if (fin && buffer.empty() && !too_large && data.size() <= limit) { return data; }
+
+      if (buffer.size() + data.size() > limit) {
+        too_large = true;
+        buffer.clear();
+      }
+      if (!too_large) { buffer.append(data); }
+
+      if (!fin) { return std::nullopt; }
+      return std::string_view{buffer};
+    }
+
+    bool overflowed() const {
+      return too_large;
+    }
+};
+
+inline GValue parse_property_value(PropertiesSchema const & schema, std::string_view name, std::string_view type, JsonParser::Value const & value) {
+  auto const entry = schema.find(name);
+  if (!entry) { throw bad_request{"Unknown property: " + std::string{name}}; }
+
+  if (!type.empty() && type != G_PARAM_SPEC_TYPE_NAME(entry->property)) {
+    throw bad_request{"Property " + std::string{name} + " is a " + G_PARAM_SPEC_TYPE_NAME(entry->property) + ", not a " + std::string{type}};
+  }
+  if (!entry->type) { throw bad_request{"Unsupported type: "s + G_PARAM_SPEC_TYPE_NAME(entry->property)}; }
+  if (!entry->writable()) { throw bad_request{"Property is not writable: " + std::string{name}}; }
+
+  return entry->parse(value);
+}
+
+// Parsed property values waiting to be applied together, owning their GValues
+class PropertyAssignments {
+  private:
+    std::vector<std::string> names;
+    std::vector<GValue> values;
+    bool force_keyframe = false;
+
+  public:
+    PropertyAssignments() = default;
+    PropertyAssignments(PropertyAssignments const &) = delete;
+    PropertyAssignments(PropertyAssignments&&) = default;
+    PropertyAssignments& operator=(PropertyAssignments const &) = delete;
+    PropertyAssignments& operator=(PropertyAssignments&& other) {
+      std::swap(names, other.names);
+      std::swap(values, other.values);
+      std::swap(force_keyframe, other.force_keyframe);
+      return *this;
+    }
+
+    ~PropertyAssignments() {
+      for (auto& value : values) {
+        g_value_unset(&value);
+      }
+    }
+
+    bool empty() const {
+      return names.empty();
+    }
+
+    std::size_t size() const {
+      return names.size();
+    }
+
+    void add(std::string name, GValue value) {
+      names.push_back(std::move(name));
+      values.push_back(value);
+    }
+
+    // Hands each assignment to f as a name and a GValue it then owns, leaving this empty
+    template <typename F>
+    void drain(F&& f) {
+      for (auto i = std::size_t{}; i < names.size(); ++i) {
+        f(std::move(names[i]), values[i]);
+      }
+      names.clear();
+      values.clear();
+    }
+
+    bool sets(std::string_view name) const {
+      return std::find(names.begin(), names.end(), name) != names.end();
+    }
+
+    // Asks for a keyframe right after these are applied
+    void forceKeyframe() {
+      force_keyframe = true;
+    }
+
+    bool forcesKeyframe() const {
+      return force_keyframe;
+    }
+
+    // Takes over the assignments of other, which win over any earlier value for the same property
+    void merge(PropertyAssignments&& other) {
+      for (auto i = std::size_t{}; i < other.names.size(); ++i) {
+        auto const existing = std::find(names.begin(), names.end(), other.names[i]);
+        if (existing == names.end()) {
+          add(std::move(other.names[i]), other.values[i]);
+        } else {
+          auto& value = values[existing - names.begin()];
+          g_value_unset(&value);
+          value = other.values[i];
+        }
+      }
+      other.names.clear();
+      other.values.clear();
+      force_keyframe = force_keyframe || std::exchange(other.force_keyframe, false);
+    }
+
+    template <typename Object>
+    void apply(Object& object) const {
+      auto c_names = std::vector<char const *>{};
+      std::transform(names.begin(), names.end(), std::back_inserter(c_names), [] (auto& name) { return name.c_str(); });
+      object.set(c_names, values);
+    }
+};
+
+// Parses one {"name", "type", "value"} object, the type being optional
+inline void parse_assignment(PropertiesSchema const & schema, JsonParser& parser, PropertyAssignments& assignments) {
+  using Kind = JsonParser::Value::Kind;
+
+  auto name = std::optional<JsonParser::Value>{};
+  auto type = std::optional<JsonParser::Value>{};
+  auto value = std::optional<JsonParser::Value>{};
+  parser.object
+    ( [&] (std::string_view key, JsonParser::Value field) {
+        if (key == "name") { name = field; }
+        else if (key == "type") { type = field; }
+        else if (key == "value") { value = field; }
+      }
+    );
+
+  if (!name || name->kind != Kind::string) { throw bad_request{"Missing property name"}; }
+  if (type && type->kind != Kind::string) { throw bad_request{"Property type must be a string"}; }
+  if (!value) { throw bad_request{"Missing property value"}; }
+
+  auto property_name = name->text();
+  auto g_value = parse_property_value(schema, property_name, type ? type->raw : std::string_view{}, *value);
+  assignments.add(std::move(property_name), g_value);
+}
+
+inline PropertyAssignments parse_set_property(PropertiesSchema const & schema, std::string_view json) {
+  auto assignments = PropertyAssignments{};
+  auto parser = JsonParser{json};
+  parse_assignment(schema, parser, assignments);
+  parser.finish();
+  return assignments;
+}
+
+// Accepts either an array of {"name", "type", "value"} objects as sent to /set_property,
+// or a single object mapping property names to values
+inline PropertyAssignments parse_set_properties(PropertiesSchema const & schema, std::string_view json) {
+  auto assignments = PropertyAssignments{};
+  auto parser = JsonParser{json};
+
+  if (parser.peek() == '[') {
+    parser.array
+      ( [&] (JsonParser& parser) {
+          parse_assignment(schema, parser, assignments);
+        }
+      );
+  } else {
+    parser.object
+      ( [&] (std::string_view key, JsonParser::Value value) {
+          auto name = std::string{key};
+          auto g_value = parse_property_value(schema, name, {}, value);
+          assignments.add(std::move(name), g_value);
+        }
+      );
+  }
+  parser.finish();
+  return assignments;
+}
+
+// Named sets of property values, saved from the current state of the camera and applied in one batch.
+// A preset is kept as the object /set_properties takes, so applying one goes through the same parsing and PropertyWriter as any other
+// write: one g_object_setv with notifications frozen, so one encoder reconfiguration.
+// All presets are persisted as a single JSON object, replaced atomically on every change. Only used from the web thread.
+class Presets {
+  private:
+    static constexpr auto max_name = std::size_t{64};
+
+    PropertiesSchema const & schema;
+    std::string path;
+    std::map<std::string, std::string, std::less<>> presets;
+    JsonWriter file;
+
+    void save() {
+      file.clear();
+      write(&file);
+
+      auto const directory = g_path_get_dirname(path.c_str());
+      g_mkdir_with_parents(directory, 0755);
+      g_free(directory);
+
+      GError *error = nullptr;
+      if (!g_file_set_contents(path.c_str(), file.view().data(), gssize(file.view().size()), &error)) {
+        g_warning("Failed to save presets: %s", error->message);
+        g_error_free(error);
+      }
+    }
+
+    static void validateName(std::string_view name) {
+      auto const valid = [] (char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_'; };
+      if (name.empty() || name.size() > max_name || !std::all_of(name.begin(), name.end(), valid)) {
+        throw bad_request{"Preset names are 1 to 64 letters, digits, - or _"};
+      }
+    }
+
+  public:
+    Presets(PropertiesSchema const & schema, std::string path) : schema{schema}, path{std::move(path)} {
+      gchar *contents = nullptr;
+      gsize length = 0;
+      GError *error = nullptr;
+      if (!g_file_get_contents(this->path.c_str(), &contents, &length, &error)) {
+        if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) { g_warning("Failed to load presets: %s", error->message); }
+        g_error_free(error);
+        return;
+      }
+
+      try {
+        auto parser = JsonParser{{contents, length}};
+        parser.object
+          ( [&] (std::string_view name, JsonParser::Value value) {
+              // Presets from another version of the element may no longer parse, which only loses that preset
+              try {
+                validateName(name);
+                parse_set_properties(schema, value.raw);
+                presets.emplace(name, value.raw);
+              } catch (bad_request const & e) {
+                g_warning("Ignoring preset %.*s: %s", int(name.size()), name.data(), e.what());
+              }
+            }
+          );
+        parser.finish();
+      } catch (bad_request const & e) {
+        g_warning("Failed to load presets: %s", e.what());
+      }
+      g_free(contents);
+    }
+
+    Presets(Presets const &) = delete;
+    Presets& operator=(Presets const &) = delete;
+
+    // {"name":{"property":value,...},...}
+    void write(JsonWriter *out) const {
+      out->write('{');
+      auto first = true;
+      for (auto const & [name, values] : presets) {
+        if (!first) { out->write(','); }
+        out->writeString(name);
+        out->write(':');
+        out->write(values);
+        first = false;
+      }
+      out->write('}');
+    }
+
+    // Saves the current values of the properties listed in json, an array of names, or of every writable property if it is empty
+    void save(std::string_view name, std::string_view json) {
+      validateName(name);
+
+      auto names = std::vector<std::string>{};
+      if (!json.empty()) {
+        auto parser = JsonParser{json};
+        parser.array
+          ( [&] (JsonParser& parser) {
+              auto const value = parser.value();
+              if (value.kind != JsonParser::Value::Kind::string) { throw bad_request{"Expected an array of property names"}; }
+              auto const entry = schema.find(value.raw);
+              if (!entry || !entry->type || !entry->writable()) { throw bad_request{"Not a writable property: " + value.text()}; }
+              names.push_back(value.text());
+            }
+          );
+        parser.finish();
+      }
+
+      auto values = JsonWriter{1024};
+      schema.writeValues
+        ( &values
+        , [&] (std::string_view property) {
+            return names.empty() || std::find(names.begin(), names.end(), property) != names.end();
+          }
+        );
+      presets.insert_or_assign(std::string{name}, values.release());
+      save();
+    }
+
+    // The assignments of a preset, or nothing if there is no such preset
+    std::optional<PropertyAssignments> get(std::string_view name) const {
+      auto const it = presets.find(name);
+      if (it == presets.end()) { return std::nullopt; }
+      return parse_set_properties(schema, it->second);
+    }
+
+    bool remove(std::string_view name) {
+      auto const it = presets.find(name);
+      if (it == presets.end()) { return false; }
+      presets.erase(it);
+      save();
+      return true;
+    }
+};
+
+// Publishes property changes of an object to the WebSocket clients subscribed to its topic.
+// Notifications arrive on whichever thread set the property, so publishing is deferred onto the uWS loop.
+class PropertyPublisher {
+  private:
+    struct Target {
+      uWS::Loop *loop;
+      uWS::App *app;
+    };
+
+    PropertiesSchema const & schema;
+    std::string const topic_;
+    Target target;
+    std::atomic<Target*> attached = nullptr;
+    std::atomic<std::uint64_t> changes = 0;
+
+    static void notify(GObject *, GParamSpec *property, gpointer data) {
+      auto& self = *static_cast<PropertyPublisher*>(data);
+      self.changes.fetch_add(1, std::memory_order_release);
+
+      auto const target = self.attached.load(std::memory_order_acquire);
+      if (!target) { return; }
+
+      auto out = JsonWriter{256};
+      if (!self.schema.writeChange(&out, property)) { return; }
+
+      target->loop->defer
+        ( [app = target->app, topic = std::string_view{self.topic_}, message = out.release()] () {
+            app->publish(topic, message, uWS::OpCode::TEXT);
+          }
+        );
+    }
+
+  public:
+    template <typename Object>
+    PropertyPublisher(Object& object, PropertiesSchema const & schema, std::string topic) : schema{schema}, topic_{std::move(topic)} {
+      object.connect("notify", G_CALLBACK(&notify), this);
+    }
+
+    PropertyPublisher(PropertyPublisher const &) = delete;
+    PropertyPublisher& operator=(PropertyPublisher const &) = delete;
+
+    std::string const & topic() const {
+      return topic_;
+    }
+
+    // Bumped on every change to a property, callable from any thread
+    std::uint64_t generation() const {
+      return changes.load(std::memory_order_acquire);
+    }
+
+    // Must be called from the thread running app
+    void attach(uWS::App& app) {
+      target = Target{uWS::Loop::get(), &app};
+      attached.store(&target, std::memory_order_release);
+    }
+};
+
+// GET /properties, rendered once per generation of property values and compressed at most once per generation and encoding.
+// The ETag names the generation and the encoding, so a dashboard polling a camera whose properties have not changed gets an empty 304.
+// Only used from the web thread.
+class PropertiesResponse {
+  private:
+    using Response = uWS::HttpResponse<false>;
+
+    struct Compressed {
+      std::string data;
+      std::string etag; // a strong validator has to differ between the encodings of the same document
+      bool valid = false;
+    };
+
+    PropertiesSchema const & schema;
+    PropertyPublisher const & publisher;
+    std::string boot = std::to_string(g_get_real_time()); // so ETags from before a restart never match
+    std::uint64_t generation = 0;
+    bool rendered = false;
+    JsonWriter json;
+    std::string etag;
+    Compressed gzipped;
+    Compressed deflated;
+
+    // window_bits as for deflateInit2: 15 for the zlib format HTTP calls deflate, 15 + 16 for gzip
+    static std::string compress(std::string_view data, int window_bits) {
+      auto stream = z_stream{};
+      if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) { return {}; }
+
+      auto result = std::string(deflateBound(&stream, uLong(data.size())), '\0');
+      stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+      stream.avail_in = uInt(data.size());
+      stream.next_out = reinterpret_cast<Bytef *>(result.data());
+      stream.avail_out = uInt(result.size());
+      auto const status = deflate(&stream, Z_FINISH);
+      result.resize(stream.total_out);
+      deflateEnd(&stream);
+      return status == Z_STREAM_END ? result : std::string{};
+    }
+
+    // Whether an Accept-Encoding header allows coding: an entry naming it decides, wherever it is in the list, and otherwise
+    // a * entry does. Either only allows it without q=0.
+    static bool accepts(std::string_view header, std::string_view coding) {
+      auto explicit_q = std::optional<double>{};
+      auto wildcard_q = std::optional<double>{};
+      while (!header.empty()) {
+        auto const end = std::min(header.find(','), header.size());
+        auto entry = header.substr(0, end);
+        header = header.substr(std::min(end + 1, header.size()));
+
+        auto const semicolon = std::min(entry.find(';'), entry.size());
+        auto parameters = entry.substr(semicolon);
+        entry = entry.substr(0, semicolon);
+        while (!entry.empty() && entry.front() == ' ') { entry.remove_prefix(1); }
+        while (!entry.empty() && entry.back() == ' ') { entry.remove_suffix(1); }
+
+        auto const named = entry.size() == coding.size() && g_ascii_strncasecmp(entry.data(), coding.data(), coding.size()) == 0;
+        if (!named && entry != "*") { continue; }
+
+        auto quality = 1.0;
+        if (auto const q = parameters.find("q="); q != std::string_view::npos) {
+          auto const value = std::string{parameters.substr(q + 2, parameters.find(';', q) - q - 2)};
+          quality = std::strtod(value.c_str(), nullptr);
+        }
+        (named ? explicit_q : wildcard_q) = quality;
+      }
+      return explicit_q.value_or(wildcard_q.value_or(0.0)) > 0;
+    }
+
+    static bool matches(std::string_view if_none_match, std::string_view etag) {
+      return if_none_match == "*" || if_none_match.find(etag) != std::string_view::npos;
+    }
+
+    void refresh() {
+      auto const current = publisher.generation();
+      if (rendered && current == generation) { return; }
+
+      // Read the generation before the values, so a change while rendering makes the next request render again
+      generation = current;
+      rendered = true;
+      json.clear();
+      schema.write(&json);
+      auto const tag = boot + "-" + std::to_string(generation);
+      etag = "\"" + tag + "\"";
+      gzipped.etag = "\"" + tag + "-gzip\"";
+      deflated.etag = "\"" + tag + "-deflate\"";
+      gzipped.valid = false;
+      deflated.valid = false;
+    }
+
+    std::string_view encoded(Compressed& cache, int window_bits) {
+      if (!cache.valid) {
+        cache.data = compress(json.view(), window_bits);
+        cache.valid = true;
+      }
+      return cache.data;
+    }
+
+  public:
+    PropertiesResponse(PropertiesSchema const & schema, PropertyPublisher const & publisher) : schema{schema}, publisher{publisher} {}
+
+    PropertiesResponse(PropertiesResponse const &) = delete;
+    PropertiesResponse& operator=(PropertiesResponse const &) = delete;
+
+    void handle(Response *res, uWS::HttpRequest *req) {
+      refresh();
+
+      // The encoding is chosen first, as it decides the ETag; each one is compressed at most once per generation
+      auto const accept_encoding = req->getHeader("accept-encoding");
+      auto coding = std::string_view{};
+      auto body = json.view();
+      auto tag = std::string_view{etag};
+      if (accepts(accept_encoding, "gzip")) {
+        coding = "gzip";
+        body = encoded(gzipped, 15 + 16);
+        tag = gzipped.etag;
+      } else if (accepts(accept_encoding, "deflate")) {
+        coding = "deflate";
+        body = encoded(deflated, 15);
+        tag = deflated.etag;
+      }
+      if (body.empty()) {
+        coding = {};
+        body = json.view();
+        tag = etag;
+      }
+
+      if (matches(req->getHeader("if-none-match"), tag)) {
+        res->writeStatus("304 Not Modified");
+        res->writeHeader("Access-Control-Allow-Origin", "*");
+        res->writeHeader("ETag", tag);
+        res->writeHeader("Cache-Control", "no-cache");
+        res->writeHeader("Vary", "Accept-Encoding");
+        res->end();
+        return;
+      }
+
+      res->cork
+        ( [&] () {
+            res->writeHeader("Access-Control-Allow-Origin", "*");
+            res->writeHeader("Content-Type", "application/json");
+            res->writeHeader("ETag", tag);
+            res->writeHeader("Cache-Control", "no-cache");
+            res->writeHeader("Vary", "Accept-Encoding");
+            if (!coding.empty()) {
+              res->writeHeader("Content-Encoding", coding);
+            }
+            res->end(body);
+          }
+        );
+    }
+};
+
+// How many property writes went through a PropertyWriter, for the metrics
+struct PropertyWriteCounters {
+  std::atomic<std::uint64_t> queued = 0;   // batches accepted from the web thread
+  std::atomic<std::uint64_t> rejected = 0; // batches refused because the queue was full
+  std::atomic<std::uint64_t> applied = 0;  // properties set on the object, after coalescing
+  std::atomic<std::uint64_t> keyframes = 0; // keyframe requests after applying that the encoder took
+};
+
+// Applies property writes from the web thread on the GLib main context, so the HTTP thread never waits on element locks.
+// Writes queued while an apply is pending are coalesced, the last write to each property winning. How often a property is
+// set is up to the PropertyDebouncer in front of it.
+// Writes that ask for a keyframe are followed by a force-key-unit event, so an encoder change shows in the next frame
+// instead of smearing until the end of the GOP.
+template <typename Object>
+class PropertyWriter {
+  private:
+    Object& object;
+    std::unique_ptr<GstPad, void (*)(gpointer)> keyframe_pad;
+    SpscQueue<PropertyAssignments, 256> queue;
+    std::atomic<bool> scheduled = false;
+    PropertyWriteCounters stats;
+
+    static gboolean apply(gpointer data) {
+      auto& self = *static_cast<PropertyWriter*>(data);
+      self.scheduled = false;
+
+      auto merged = PropertyAssignments{};
+      while (auto assignments = self.queue.pop()) {
+        merged.merge(std::move(*assignments));
+      }
+      if (!merged.empty()) {
+        self.stats.applied.fetch_add(merged.size(), std::memory_order_relaxed);
+        merged.apply(self.object);
+      }
+      if (merged.forcesKeyframe() && Gst::request_keyframe(self.keyframe_pad.get())) {
+        self.stats.keyframes.fetch_add(1, std::memory_order_relaxed);
+      }
+      return G_SOURCE_REMOVE;
+    }
+
+  public:
+    // downstream is the element after the encoder, whose sink pad keyframe requests are pushed upstream from
+    PropertyWriter(Object& object, Gst::Element const & downstream) : object{object}, keyframe_pad{downstream.static_pad("sink")} {}
+
+    PropertyWriter(PropertyWriter const &) = delete;
+    PropertyWriter& operator=(PropertyWriter const &) = delete;
+
+    // Only to be called from the web thread, returns false if the queue is full
+    bool write(PropertyAssignments assignments) {
+      if (assignments.empty()) { return true; }
+      if (!queue.push(std::move(assignments))) {
+        stats.rejected.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      stats.queued.fetch_add(1, std::memory_order_relaxed);
+
+      if (!scheduled.exchange(true)) {
+        g_idle_add_full(G_PRIORITY_HIGH, &apply, this, nullptr);
+      }
+      return true;
+    }
+
+    PropertyWriteCounters const & counters() const {
+      return stats;
+    }
+};
+
+// The destinations a multiudpsink sends the stream to, changed at runtime without touching the rest of the pipeline.
+// With RTCP, a second multiudpsink sends sender reports to port + 1 of each destination.
+class UdpClients {
+  private:
+    Gst::Element sink;
+    std::optional<Gst::Element> rtcp_sink;
+    GLib::Property clients; // only read from the web thread
+
+    template <typename F>
+    void forEach(F&& client) {
+      auto const current = clients.get<char const *>();
+      auto list = std::string_view{current ? current : ""};
+      while (!list.empty()) {
+        auto const end = std::min(list.find(','), list.size());
+        auto const entry = list.substr(0, end);
+        list = list.substr(std::min(end + 1, list.size()));
+
+        auto const colon = entry.rfind(':');
+        auto port = gint{};
+        if (colon == std::string_view::npos) { continue; }
+        std::from_chars(entry.data() + colon + 1, entry.data() + entry.size(), port);
+        client(entry.substr(0, colon), port);
+      }
+    }
+
+  public:
+    explicit UdpClients(Gst::Element sink, std::optional<Gst::Element> rtcp_sink = std::nullopt) : sink{sink}, rtcp_sink{rtcp_sink}, clients{sink["clients"]} {
+      if (rtcp_sink) {
+        forEach([&] (std::string_view host, gint port) { rtcp_sink->emit("add", std::string{host}.c_str(), port + 1); });
+      }
+    }
+
+    // Throws bad_request unless text is a whole port number, 1 to 65535
+    static gint parsePort(std::string_view text) {
+      auto port = gint{};
+      auto const res = std::from_chars(text.data(), text.data() + text.size(), port);
+      if (res.ec != std::errc{} || res.ptr != text.data() + text.size() || port < 1 || port > 65535) {
+        throw bad_request{"Invalid port: " + std::string{text}};
+      }
+      return port;
+    }
+
+    static std::pair<std::string, gint> parse(std::string_view json) {
+      using Kind = JsonParser::Value::Kind;
+
+      auto host = std::string{};
+      auto port = std::optional<gint>{};
+      auto parser = JsonParser{json};
+      parser.object
+        ( [&] (std::string_view key, JsonParser::Value value) {
+            if (key == "host" && value.kind == Kind::string) {
+              host = value.text();
+            } else if (key == "port") {
+              if (value.kind != Kind::number) { throw bad_request{"Invalid port: " + std::string{value.raw}}; }
+              port = parsePort(value.raw);
+            }
+          }
+        );
+      parser.finish();
+
+      if (host.empty()) { throw bad_request{"Missing host"}; }
+      if (!port) { throw bad_request{"Missing port"}; }
+      return {host, *port};
+    }
+
+    void write(JsonWriter *out) {
+      out->write('[');
+      auto first = true;
+      forEach
+        ( [&] (std::string_view host, gint port) {
+            out->write(first ? "{\"host\":" : ",{\"host\":");
+            out->writeString(host);
+            writeField(out, "port", port);
+            out->write('}');
+            first = false;
+          }
+        );
+      out->write(']');
+    }
+
+    bool contains(std::string_view host, gint port) {
+      auto found = false;
+      forEach([&] (std::string_view client_host, gint client_port) { found = found || (client_host == host && client_port == port); });
+      return found;
+    }
+
+    // multiudpsink only holds its client list lock briefly, so these are safe to call from the web thread
+    void add(std::string const & host, gint port) {
+      sink.emit("add", host.c_str(), port);
+      if (rtcp_sink) { rtcp_sink->emit("add", host.c_str(), port + 1); }
+    }
+
+    void remove(std::string const & host, gint port) {
+      sink.emit("remove", host.c_str(), port);
+      if (rtcp_sink) { rtcp_sink->emit("remove", host.c_str(), port + 1); }
+    }
+};
+
+// Serves the encoded H.264 access units to WebSocket clients on /stream without re-encoding, for playback with MSE or WebCodecs.
+// A client first gets the caps as a text message, then one binary message per access unit:
+// a flags byte (bit 0 set on keyframes), the presentation time in microseconds as a little endian uint64, then the Annex B data.
+// Clients that fall behind skip ahead to the next keyframe rather than building up a backlog.
+class VideoStream {
+  private:
+    static constexpr auto max_buffered = 512u * 1024;
+    static constexpr auto keyframe_request_interval = gint64{1000000}; // µs
+    static constexpr auto max_in_flight = 4; // samples deferred to the web thread and not sent yet
+
+    struct Socket {
+      bool waiting_for_keyframe = true;
+    };
+    using WebSocket = uWS::WebSocket<false, true, Socket>;
+
+    Gst::Element appsink;
+    std::atomic<std::uint64_t>& drops;
+    std::atomic<uWS::Loop*> loop = nullptr;
+    std::atomic<int> client_count = 0;
+    std::atomic<int> in_flight = 0;
+    std::atomic<bool> dropped = false; // clients have missed a frame and must wait for a keyframe
+
+    // only touched on the web thread
+    std::vector<WebSocket*> sockets;
+    std::string message;
+    gint64 last_keyframe_request = 0;
+
+    static GstFlowReturn new_sample(GstAppSink *appsink, gpointer data) {
+      auto& self = *static_cast<VideoStream*>(data);
+
+      auto const sample = gst_app_sink_pull_sample(appsink);
+      if (!sample) { return GST_FLOW_OK; }
+
+      auto const loop = self.loop.load(std::memory_order_acquire);
+      if (!loop || self.client_count.load(std::memory_order_relaxed) == 0) {
+        gst_sample_unref(sample);
+        return GST_FLOW_OK;
+      }
+
+      // A stalled web thread would otherwise pile up deferred frames without bound
+      if (self.in_flight.load(std::memory_order_relaxed) >= max_in_flight) {
+        gst_sample_unref(sample);
+        self.drops.fetch_add(1, std::memory_order_relaxed);
+        self.dropped.store(true, std::memory_order_relaxed);
+        return GST_FLOW_OK;
+      }
+      self.in_flight.fetch_add(1, std::memory_order_relaxed);
+
+      loop->defer
+        ( [&self, sample] () {
+            self.in_flight.fetch_sub(1, std::memory_order_relaxed);
+            self.send(gst_sample_get_buffer(sample));
+            gst_sample_unref(sample);
+          }
+        );
+      return GST_FLOW_OK;
+    }
+
+    void send(GstBuffer *buffer) {
+      auto map = GstMapInfo GST_MAP_INFO_INIT;
+      if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) { return; }
+
+      auto const keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+      auto const pts = GST_CLOCK_TIME_IS_VALID(GST_BUFFER_PTS(buffer)) ? GST_BUFFER_PTS(buffer) / GST_USECOND : 0;
+
+      message.clear();
+      message.push_back(char(keyframe ? 1 : 0));
+      for (auto shift = 0; shift < 64; shift += 8) {
+        message.push_back(char((pts >> shift) & 0xff));
+      }
+      message.append(reinterpret_cast<char const *>(map.data), map.size);
+      gst_buffer_unmap(buffer, &map);
+
+      auto const resync = dropped.exchange(false, std::memory_order_relaxed);
+      auto any_waiting = false;
+      for (auto ws : sockets) {
+        auto& state = *ws->getUserData();
+        if (resync) {
+          state.waiting_for_keyframe = true;
+        }
+        if (keyframe) {
+          state.waiting_for_keyframe = false;
+        }
+        if (!state.waiting_for_keyframe && ws->getBufferedAmount() > max_buffered) {
+          state.waiting_for_keyframe = true;
+        }
+        if (state.waiting_for_keyframe) {
+          any_waiting = true;
+          continue;
+        }
+        ws->send(message, uWS::OpCode::BINARY);
+      }
+
+      if (any_waiting) {
+        requestKeyframe();
+      }
+    }
+
+    // Asks the encoder for an IDR so that new or lagging clients do not wait a whole GOP, at most once per interval
+    void requestKeyframe() {
+      auto const now = g_get_monotonic_time();
+      if (now - last_keyframe_request < keyframe_request_interval) { return; }
+      last_keyframe_request = now;
+
+      Gst::request_keyframe(appsink.static_pad("sink").get());
+    }
+
+    std::string caps() {
+      auto const pad = appsink.static_pad("sink");
+      auto const caps = gst_pad_get_current_caps(pad.get());
+      if (!caps) { return {}; }
+
+      auto const text = gst_caps_to_string(caps);
+      auto result = std::string{text};
+      g_free(text);
+      gst_caps_unref(caps);
+      return result;
+    }
+
+  public:
+    // drops counts the frames dropped because the web thread is behind
+    VideoStream(Gst::Element appsink, std::atomic<std::uint64_t>& drops) : appsink{appsink}, drops{drops} {
+      appsink["caps"] = Gst::caps_value("video/x-h264,stream-format=byte-stream,alignment=au");
+      appsink["sync"] = false;
+      appsink["max-buffers"] = 2u;
+      appsink["drop"] = true;
+
+      auto callbacks = GstAppSinkCallbacks{};
+      callbacks.new_sample = &new_sample;
+      gst_app_sink_set_callbacks(GST_APP_SINK(appsink.get()), &callbacks, this, nullptr);
+    }
+
+    VideoStream(VideoStream const &) = delete;
+    VideoStream& operator=(VideoStream const &) = delete;
+
+    // Serves the stream on pattern, may be called for several patterns; must be called from the thread running app
+    void attach(uWS::App& app, std::string const & pattern) {
+      auto behavior = uWS::App::WebSocketBehavior<Socket>{};
+      behavior.maxBackpressure = 4 * max_buffered;
+      behavior.open = [this] (auto *ws) {
+          sockets.push_back(ws);
+          client_count.fetch_add(1, std::memory_order_relaxed);
+          if (auto const current = caps(); !current.empty()) {
+            ws->send(current, uWS::OpCode::TEXT);
+          }
+          requestKeyframe();
+        };
+      behavior.close = [this] (auto *ws, int, std::string_view) {
+          sockets.erase(std::remove(sockets.begin(), sockets.end(), ws), sockets.end());
+          client_count.fetch_sub(1, std::memory_order_relaxed);
+        };
+      app.ws<Socket>(pattern, std::move(behavior));
+
+      loop.store(uWS::Loop::get(), std::memory_order_release);
+    }
+};
+
+// Lock-free histogram of durations in microseconds, with four buckets per power of two, so quantiles are within 25%.
+// record() can run on any number of streaming threads at once; reads see a slightly torn but consistent enough view.
+class LatencyHistogram {
+  private:
+    static constexpr auto max_log2 = 34; // about 4.7 hours, longer durations land in the last bucket
+    static constexpr auto bucket_count = std::size_t{max_log2 * 4};
+
+    std::array<std::atomic<std::uint64_t>, bucket_count> buckets{};
+    std::atomic<std::uint64_t> maximum = 0;
+
+    static std::size_t index(std::uint64_t value) {
+      if (value < 4) { return std::size_t(value); }
+      auto const log2 = std::min(63 - __builtin_clzll(value), max_log2 - 1);
+      auto const sub_bucket = (std::min(value, (std::uint64_t{1} << max_log2) - 1) >> (log2 - 2)) & 3;
+      return std::size_t(log2 - 1) * 4 + std::size_t(sub_bucket);
+    }
+
+    // The largest value that lands in bucket i
+    static std::uint64_t upperBound(std::size_t i) {
+      if (i < 4) { return i; }
+      auto const log2 = i / 4 + 1;
+      return ((4 + i % 4 + 1) << (log2 - 2)) - 1;
+    }
+
+  public:
+    void record(std::uint64_t value) {
+      buckets[index(value)].fetch_add(1, std::memory_order_relaxed);
+      auto current = maximum.load(std::memory_order_relaxed);
+      while (value > current && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+    }
+
+    void reset() {
+      for (auto& bucket : buckets) { bucket.store(0, std::memory_order_relaxed); }
+      maximum.store(0, std::memory_order_relaxed);
+    }
+
+    struct Summary {
+      std::uint64_t count;
+      std::uint64_t p50;
+      std::uint64_t p99;
+      std::uint64_t max;
+    };
+
+    Summary summary() const {
+      auto counts = std::array<std::uint64_t, bucket_count>{};
+      auto total = std::uint64_t{};
+      for (auto i = std::size_t{}; i < bucket_count; ++i) {
+        counts[i] = buckets[i].load(std::memory_order_relaxed);
+        total += counts[i];
+      }
+
+      auto const quantile = [&] (double q) {
+          auto const rank = std::uint64_t(std::ceil(q * double(total)));
+          auto seen = std::uint64_t{};
+          for (auto i = std::size_t{}; i < bucket_count; ++i) {
+            seen += counts[i];
+            if (seen >= rank && seen > 0) { return upperBound(i); }
+          }
+          return std::uint64_t{};
+        };
+
+      return {total, quantile(0.5), quantile(0.99), maximum.load(std::memory_order_relaxed)};
+    }
+
+    // {"count":N,"p50":µs,"p99":µs,"max":µs}
+    void write(JsonWriter *out) const {
+      auto const summary = this->summary();
+      out->write("{\"count\":");
+      writeData(out, summary.count);
+      writeField(out, "p50", summary.p50);
+      writeField(out, "p99", summary.p99);
+      writeField(out, "max", summary.max);
+      out->write('}');
+    }
+};
+
+// Measures how long after capture each buffer reaches a number of pads, as the pipeline's running time minus the buffer's PTS
+// (rpicamsrc stamps buffers with their capture time). The probes are only installed while enabled, so when switched off they cost nothing;
+// when on, each buffer pays for a clock read and a few relaxed atomic increments.
+class LatencyProbes {
+  private:
+    struct Stage {
+      LatencyProbes *self;
+      std::string name;
+      std::unique_ptr<GstPad, void (*)(gpointer)> pad;
+      gulong probe = 0;
+      LatencyHistogram histogram;
+
+      Stage(LatencyProbes *self, std::string name, GstPad *pad) : self{self}, name{std::move(name)}, pad{pad, gst_object_unref} {}
+    };
+
+    Gst::Element pipeline;
+    std::vector<std::unique_ptr<Stage>> stages;
+    bool enabled = false; // only touched on the web thread
+
+    static GstPadProbeReturn probe(GstPad *, GstPadProbeInfo *info, gpointer data) {
+      auto& stage = *static_cast<Stage*>(data);
+
+      auto buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+      if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        auto const list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        buffer = gst_buffer_list_length(list) > 0 ? gst_buffer_list_get(list, 0) : nullptr;
+      }
+      if (!buffer || !GST_CLOCK_TIME_IS_VALID(GST_BUFFER_PTS(buffer))) { return GST_PAD_PROBE_OK; }
+
+      auto const element = stage.self->pipeline.get();
+      auto const clock = gst_element_get_clock(element);
+      if (!clock) { return GST_PAD_PROBE_OK; }
+      auto const running_time = GstClockTimeDiff(gst_clock_get_time(clock) - gst_element_get_base_time(element));
+      gst_object_unref(clock);
+
+      auto const latency = running_time - GstClockTimeDiff(GST_BUFFER_PTS(buffer));
+      stage.histogram.record(latency > 0 ? std::uint64_t(latency) / GST_USECOND : 0);
+      return GST_PAD_PROBE_OK;
+    }
+
+  public:
+    explicit LatencyProbes(Gst::Element pipeline) : pipeline{pipeline} {}
+
+    LatencyProbes(LatencyProbes const &) = delete;
+    LatencyProbes& operator=(LatencyProbes const &) = delete;
+
+    ~LatencyProbes() {
+      enable(false);
+    }
+
+    // Stages are reported in the order they are added, which should follow the flow of buffers
+    void add(std::string name, Gst::Element const & element, char const *pad) {
+      stages.push_back(std::make_unique<Stage>(this, std::move(name), element.static_pad(pad).release()));
+    }
+
+    // Pad probes can be added and removed from any thread; histograms start from scratch each time the probes are enabled
+    void enable(bool enable) {
+      if (enable == enabled) { return; }
+      enabled = enable;
+      for (auto& stage : stages) {
+        if (!stage->pad) { continue; }
+        if (enable) {
+          stage->histogram.reset();
+          stage->probe = gst_pad_add_probe
+            ( stage->pad.get()
+            , GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST)
+            , &probe
+            , stage.get()
+            , nullptr
+            );
+        } else if (stage->probe) {
+          gst_pad_remove_probe(stage->pad.get(), std::exchange(stage->probe, 0));
+        }
+      }
+    }
+
+    // {"enabled":bool}
+    static bool parse(std::string_view json) {
+      using Kind = JsonParser::Value::Kind;
+
+      auto enabled = std::optional<bool>{};
+      auto parser = JsonParser{json};
+      parser.object
+        ( [&] (std::string_view key, JsonParser::Value value) {
+            if (key == "enabled" && value.kind == Kind::boolean) {
+              enabled = value.raw == "true";
+            }
+          }
+        );
+      parser.finish();
+
+      if (!enabled) { throw bad_request{"Missing enabled"}; }
+      return *enabled;
+    }
+
+    // {"enabled":bool,"stages":[{"name":...,"count":N,"p50":µs,"p99":µs,"max":µs},...]}
+    void write(JsonWriter *out) const {
+      out->write("{\"enabled\":");
+      writeData(out, enabled);
+      out->write(",\"stages\":[");
+      auto first = true;
+      for (auto const & stage : stages) {
+        out->write(first ? "{\"name\":" : ",{\"name\":");
+        out->writeString(stage->name);
+        out->write(',');
+        stage->histogram.write(out);
+        out->write('}');
+        first = false;
+      }
+      out->write("]}");
+    }
+};
+
+// Counters behind GET /metrics, in the Prometheus text exposition format.
+// Streaming threads only ever do relaxed atomic increments on them, and the web thread reads them without taking any lock
+// the video path could be waiting on.
+class Metrics {
+  public:
+    // Requests to one route of the control interface, only recorded from the web thread
+    struct Route {
+      struct Span {
+        gint64 start;
+        gint64 end;
+      };
+
+      std::string pattern;
+      LatencyHistogram duration;
+      std::atomic<std::uint64_t> total_duration = 0;
+      std::vector<Span> *spans = nullptr; // every request is added here while a profile runs
+
+      explicit Route(std::string pattern) : pattern{std::move(pattern)} {}
+
+      void record(gint64 start) {
+        auto const end = g_get_monotonic_time();
+        auto const duration_us = std::uint64_t(std::max(end - start, gint64{0}));
+        duration.record(duration_us);
+        total_duration.fetch_add(duration_us, std::memory_order_relaxed);
+        if (spans) { spans->push_back(Span{start, end}); }
+      }
+    };
+
+  private:
+    struct Buffers {
+      std::atomic<std::uint64_t> pushes = 0; // buffers and buffer lists, each one call into the element
+      std::atomic<std::uint64_t> count = 0;
+      std::atomic<std::uint64_t> bytes = 0;
+      std::atomic<std::uint64_t> keyframes = 0;
+    };
+
+    struct Drops {
+      std::string queue;
+      std::atomic<std::uint64_t> count = 0;
+
+      explicit Drops(std::string queue) : queue{std::move(queue)} {}
+    };
+
+    Buffers frames;
+    Buffers packets;
+    std::deque<Drops> drops;
+    std::atomic<std::uint64_t> late = 0;
+    std::atomic<std::uint64_t> errors = 0;
+    std::atomic<std::uint64_t> warnings = 0;
+    std::atomic<int> state = GST_STATE_NULL;
+    std::atomic<std::uint64_t> restarts = 0;
+    // Since the process started, 0 until reached
+    std::atomic<gint64> listened_after = 0;
+    std::atomic<gint64> first_buffer_after = 0;
+    LatencyHistogram recovery; // from the failure to the first buffer after the restart
+    std::deque<Route> routes;
+
+    // For the rates, which cover the time since the previous scrape; only touched on the web thread
+    gint64 last_scrape = 0;
+    std::uint64_t last_frames = 0;
+    std::uint64_t last_bytes = 0;
+    std::uint64_t last_sends = 0;
+
+    static GstPadProbeReturn countBuffers(GstPad *, GstPadProbeInfo *info, gpointer data) {
+      auto& buffers = *static_cast<Buffers*>(data);
+      buffers.pushes.fetch_add(1, std::memory_order_relaxed);
+      if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        auto const list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        buffers.count.fetch_add(gst_buffer_list_length(list), std::memory_order_relaxed);
+        buffers.bytes.fetch_add(gst_buffer_list_calculate_size(list), std::memory_order_relaxed);
+      } else {
+        auto const buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+        buffers.count.fetch_add(1, std::memory_order_relaxed);
+        buffers.bytes.fetch_add(gst_buffer_get_size(buffer), std::memory_order_relaxed);
+        if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+          buffers.keyframes.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+      return GST_PAD_PROBE_OK;
+    }
+
+    // A leaky queue emits overrun each time a buffer arrives while it is full, just before dropping one
+    static void overrun(GstElement *, gpointer data) {
+      static_cast<Drops*>(data)->count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void countOn(Gst::Element const & element, char const *pad, Buffers& buffers) {
+      gst_pad_add_probe
+        ( element.static_pad(pad).get()
+        , GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST)
+        , &countBuffers
+        , &buffers
+        , nullptr
+        );
+    }
+
+    static void header(JsonWriter *out, char const *name, char const *type, char const *help) {
+      out->write("# HELP ");
+      out->write(name);
+      out->write(' ');
+      out->write(help);
+      out->write("\n# TYPE ");
+      out->write(name);
+      out->write(' ');
+      out->write(type);
+      out->write('\n');
+    }
+
+    template <typename T>
+    static void sample(JsonWriter *out, char const *name, T value, std::string_view labels = {}) {
+      out->write(name);
+      if (!labels.empty()) {
+        out->write('{');
+        out->write(labels);
+        out->write('}');
+      }
+      out->write(' ');
+      writeData(out, value);
+      out->write('\n');
+    }
+
+    template <typename T>
+    static void metric(JsonWriter *out, char const *name, char const *type, char const *help, T value) {
+      header(out, name, type, help);
+      sample(out, name, value);
+    }
+
+  public:
+    Metrics() = default;
+    Metrics(Metrics const &) = delete;
+    Metrics& operator=(Metrics const &) = delete;
+
+    // The following register what to count, and must be called before the web thread starts
+
+    // Encoded frames, on the src pad of the encoder
+    void countFrames(Gst::Element const & element, char const *pad) {
+      countOn(element, pad, frames);
+    }
+
+    // RTP packets, on the sink pad of the network sink
+    void countPackets(Gst::Element const & element, char const *pad) {
+      countOn(element, pad, packets);
+    }
+
+    // Returns the counter, for anything else that drops buffers on behalf of the queue
+    std::atomic<std::uint64_t>& countDrops(Gst::Element& queue) {
+      auto& entry = drops.emplace_back(queue["name"].get<char const *>());
+      queue.connect("overrun", G_CALLBACK(&overrun), &entry);
+      return entry.count;
+    }
+
+    Route& route(std::string pattern) {
+      return routes.emplace_back(std::move(pattern));
+    }
+
+    template <typename F>
+    void forEachRoute(F&& f) {
+      for (auto& route : routes) {
+        f(route);
+      }
+    }
+
+    // Called with every message on the pipeline's bus
+    void observe(GstMessage *message, GstElement *pipeline) {
+      switch (GST_MESSAGE_TYPE(message)) {
+        case GST_MESSAGE_ERROR: errors.fetch_add(1, std::memory_order_relaxed); break;
+        case GST_MESSAGE_WARNING: warnings.fetch_add(1, std::memory_order_relaxed); break;
+        // Sinks post QoS messages for buffers that arrive too late to be rendered on time
+        case GST_MESSAGE_QOS: late.fetch_add(1, std::memory_order_relaxed); break;
+        case GST_MESSAGE_STATE_CHANGED:
+          if (GST_MESSAGE_SRC(message) == GST_OBJECT(pipeline)) {
+            auto current = GstState{};
+            gst_message_parse_state_changed(message, nullptr, &current, nullptr);
+            state.store(current, std::memory_order_relaxed);
+          }
+          break;
+        default: break;
+      }
+    }
+
+    // Called from the web thread once the control interface listens, with the time since the process started
+    void listened(gint64 after_us) {
+      listened_after.store(after_us, std::memory_order_relaxed);
+    }
+
+    // Called on the main context once the pipeline first produces, with the time since the process started
+    void firstBuffer(gint64 after_us) {
+      first_buffer_after.store(after_us, std::memory_order_relaxed);
+    }
+
+    // Called on the main context as a failed pipeline is restarted
+    void restarted() {
+      restarts.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Called from the streaming thread once a restarted pipeline produces again
+    void recovered(gint64 duration_us) {
+      recovery.record(std::uint64_t(std::max(duration_us, gint64{0})));
+    }
+
+    // Only to be called from the web thread
+    void write(JsonWriter *out, PropertyWriteCounters const & properties) {
+      auto const now = g_get_monotonic_time();
+      auto const frame_count = frames.count.load(std::memory_order_relaxed);
+      auto const frame_bytes = frames.bytes.load(std::memory_order_relaxed);
+      auto const interval = double(now - last_scrape) / G_USEC_PER_SEC;
+      auto const fps = last_scrape ? double(frame_count - last_frames) / interval : 0.0;
+      auto const bitrate = last_scrape ? double(frame_bytes - last_bytes) * 8 / interval : 0.0;
+      // multiudpsink sends each buffer, or each buffer list in one go, with one sendmmsg per address family
+      auto const sends = packets.pushes.load(std::memory_order_relaxed);
+      auto const sends_per_frame = frame_count != last_frames ? double(sends - last_sends) / double(frame_count - last_frames) : 0.0;
+      last_sends = sends;
+      last_scrape = now;
+      last_frames = frame_count;
+      last_bytes = frame_bytes;
+
+      metric(out, "rpi_cam_frames_total", "counter", "Encoded frames produced by the camera", frame_count);
+      metric(out, "rpi_cam_keyframes_total", "counter", "Encoded keyframes produced by the camera", frames.keyframes.load(std::memory_order_relaxed));
+      metric(out, "rpi_cam_encoded_bytes_total", "counter", "Bytes of encoded video produced by the camera", frame_bytes);
+      metric(out, "rpi_cam_frames_per_second", "gauge", "Encoded frame rate since the previous scrape", fps);
+      metric(out, "rpi_cam_encoded_bitrate_bits_per_second", "gauge", "Encoded bitrate since the previous scrape", bitrate);
+      metric(out, "rpi_cam_udp_packets_total", "counter", "RTP packets handed to udpsink, each sent to every destination", packets.count.load(std::memory_order_relaxed));
+      metric(out, "rpi_cam_udp_sends_total", "counter", "Buffers and buffer lists handed to udpsink, each sent to every destination with one sendmmsg", sends);
+      metric(out, "rpi_cam_udp_sends_per_frame", "gauge", "Sends by udpsink per encoded frame since the previous scrape", sends_per_frame);
+      metric(out, "rpi_cam_udp_bytes_total", "counter", "Bytes of RTP handed to udpsink, each sent to every destination", packets.bytes.load(std::memory_order_relaxed));
+
+      header(out, "rpi_cam_dropped_buffers_total", "counter", "Buffers dropped by leaky queues because their consumer fell behind");
+      for (auto const & entry : drops) {
+        sample(out, "rpi_cam_dropped_buffers_total", entry.count.load(std::memory_order_relaxed), "queue=\"" + entry.queue + "\"");
+      }
+      metric(out, "rpi_cam_late_buffers_total", "counter", "QoS messages posted by sinks for late buffers", late.load(std::memory_order_relaxed));
+      metric(out, "rpi_cam_pipeline_errors_total", "counter", "Errors posted on the pipeline bus", errors.load(std::memory_order_relaxed));
+      metric(out, "rpi_cam_pipeline_warnings_total", "counter", "Warnings posted on the pipeline bus", warnings.load(std::memory_order_relaxed));
+      metric(out, "rpi_cam_pipeline_state", "gauge", "Current state of the pipeline (1 NULL, 2 READY, 3 PAUSED, 4 PLAYING)", state.load(std::memory_order_relaxed));
+      metric(out, "rpi_cam_startup_listen_seconds", "gauge", "Time from process start until the control interface listened", double(listened_after.load(std::memory_order_relaxed)) / G_USEC_PER_SEC);
+      metric(out, "rpi_cam_startup_first_buffer_seconds", "gauge", "Time from process start until the camera produced its first frame, 0 until it has", double(first_buffer_after.load(std::memory_order_relaxed)) / G_USEC_PER_SEC);
+      metric(out, "rpi_cam_pipeline_restarts_total", "counter", "Restarts of the pipeline after an error or end of stream", restarts.load(std::memory_order_relaxed));
+      {
+        auto const summary = recovery.summary();
+        auto const name = "rpi_cam_pipeline_recovery_duration_microseconds";
+        header(out, name, "summary", "Time from a pipeline failure to the first frame after its restart");
+        sample(out, name, summary.p50, "quantile=\"0.5\"");
+        sample(out, name, summary.p99, "quantile=\"0.99\"");
+        sample(out, "rpi_cam_pipeline_recovery_duration_microseconds_count", summary.count);
+        metric(out, "rpi_cam_pipeline_recovery_duration_max_microseconds", "gauge", "Longest time to recover from a pipeline failure", summary.max);
+      }
+
+      metric(out, "rpi_cam_property_writes_total", "counter", "Property writes queued for the camera", properties.queued.load(std::memory_order_relaxed));
+      metric(out, "rpi_cam_property_writes_rejected_total", "counter", "Property writes refused because the queue was full", properties.rejected.load(std::memory_order_relaxed));
+      metric(out, "rpi_cam_property_sets_total", "counter", "Properties set on the camera, after coalescing", properties.applied.load(std::memory_order_relaxed));
+      metric(out, "rpi_cam_property_keyframes_total", "counter", "Keyframes forced so that property changes show at once", properties.keyframes.load(std::memory_order_relaxed));
+
+      auto const name = "rpi_cam_http_request_duration_microseconds";
+      header(out, name, "summary", "Time taken to answer requests to the control interface");
+      for (auto const & route : routes) {
+        auto const summary = route.duration.summary();
+        auto const labels = "route=\"" + route.pattern + "\"";
+        sample(out, name, summary.p50, labels + ",quantile=\"0.5\"");
+        sample(out, name, summary.p99, labels + ",quantile=\"0.99\"");
+        sample(out, "rpi_cam_http_request_duration_microseconds_sum", route.total_duration.load(std::memory_order_relaxed), labels);
+        sample(out, "rpi_cam_http_request_duration_microseconds_count", summary.count, labels);
+      }
+    }
+};
+
+// Watches the bus of a pipeline on the main context: logs errors and warnings, feeds the metrics, and restarts the pipeline
+// after an error or end of stream. The elements are kept, and with them every property set on them, so a restart only reopens
+// the camera and the encoder. A restart that fails again is retried after a backoff that doubles up to max_backoff_ms.
+class PipelineWatch {
+  private:
+    static constexpr auto min_backoff_ms = 100u;
+    static constexpr auto max_backoff_ms = 10000u;
+
+    Gst::Element pipeline;
+    Gst::Element source;
+    Metrics& metrics;
+    guint watch;
+    guint restart_timer = 0; // only touched on the main context
+    gint64 const started; // when the process started
+    bool producing = false; // whether the pipeline has produced at all, only touched on the main context
+    gint64 failed_at = 0; // the first failure since the pipeline last produced, 0 while it is healthy; written on the main context
+    std::atomic<guint> backoff_ms = min_backoff_ms;
+    std::atomic<bool> awaiting_recovery = true; // until the first buffer
+    std::vector<std::function<void()>> error_handlers; // only touched on the main context
+
+    static gboolean message(GstBus *, GstMessage *message, gpointer data) {
+      auto& self = *static_cast<PipelineWatch*>(data);
+      self.metrics.observe(message, self.pipeline.get());
+
+      auto const type = GST_MESSAGE_TYPE(message);
+      if (type == GST_MESSAGE_ERROR || type == GST_MESSAGE_WARNING) {
+        GError *error = nullptr;
+        gchar *debug = nullptr;
+        if (type == GST_MESSAGE_ERROR) {
+          gst_message_parse_error(message, &error, &debug);
+        } else {
+          gst_message_parse_warning(message, &error, &debug);
+        }
+        g_warning
+          ( "%s from %s in %s: %s (%s)"
+          , type == GST_MESSAGE_ERROR ? "Error" : "Warning"
+          , GST_MESSAGE_SRC_NAME(message)
+          , self.pipeline["name"].get<char const *>()
+          , error->message
+          , debug ? debug : "no details"
+          );
+        g_error_free(error);
+        g_free(debug);
+      }
+      if (type == GST_MESSAGE_ERROR) {
+        for (auto& handler : self.error_handlers) { handler(); }
+      }
+      if (type == GST_MESSAGE_ERROR || type == GST_MESSAGE_EOS) {
+        self.scheduleRestart();
+      }
+      return G_SOURCE_CONTINUE;
+    }
+
+    void scheduleRestart() {
+      // One failure usually posts several errors, and they all wait for the same restart
+      if (restart_timer) { return; }
+      if (!failed_at) { failed_at = g_get_monotonic_time(); }
+
+      auto const backoff = backoff_ms.load(std::memory_order_relaxed);
+      backoff_ms.store(std::min(backoff * 2, max_backoff_ms), std::memory_order_relaxed);
+      g_warning("Restarting %s in %ums", pipeline["name"].get<char const *>(), backoff);
+      restart_timer = g_timeout_add(backoff, &restart, this);
+    }
+
+    static gboolean restart(gpointer data) {
+      auto& self = *static_cast<PipelineWatch*>(data);
+      self.restart_timer = 0;
+      self.metrics.restarted();
+
+      self.pipeline.set_state(GST_STATE_NULL);
+      // Whatever the failed run posted after the error is stale now
+      auto const bus = gst_element_get_bus(self.pipeline.get());
+      gst_bus_set_flushing(bus, TRUE);
+      gst_bus_set_flushing(bus, FALSE);
+      gst_object_unref(bus);
+
+      if (!self.awaiting_recovery.exchange(true)) {
+        gst_pad_add_probe(self.source.static_pad("src").get(), GST_PAD_PROBE_TYPE_BUFFER, &produced, data, nullptr);
+      }
+      if (!self.pipeline.set_state(GST_STATE_PLAYING)) {
+        self.scheduleRestart();
+      }
+      return G_SOURCE_REMOVE;
+    }
+
+    // The first buffer after a restart, on the streaming thread
+    static GstPadProbeReturn produced(GstPad *, GstPadProbeInfo *, gpointer data) {
+      auto& self = *static_cast<PipelineWatch*>(data);
+      self.backoff_ms.store(min_backoff_ms, std::memory_order_relaxed);
+      self.awaiting_recovery.store(false, std::memory_order_relaxed);
+      g_idle_add(&recovered, data);
+      return GST_PAD_PROBE_REMOVE;
+    }
+
+    static gboolean recovered(gpointer data) {
+      auto& self = *static_cast<PipelineWatch*>(data);
+      if (!self.producing) {
+        self.producing = true;
+        auto const after = g_get_monotonic_time() - self.started;
+        self.metrics.firstBuffer(after);
+        g_message("%s produced its first frame %" G_GINT64_FORMAT "ms after startup", self.pipeline["name"].get<char const *>(), after / 1000);
+      }
+      if (self.failed_at) {
+        auto const duration = g_get_monotonic_time() - self.failed_at;
+        self.metrics.recovered(duration);
+        g_message("%s recovered after %" G_GINT64_FORMAT "ms", self.pipeline["name"].get<char const *>(), duration / 1000);
+        self.failed_at = 0;
+      }
+      return G_SOURCE_REMOVE;
+    }
+
+  public:
+    // source is the head of the pipeline, whose first buffer, and first buffer after a restart, are timed from started
+    PipelineWatch(Gst::Element pipeline, Gst::Element source, Metrics& metrics, gint64 started)
+      : pipeline{pipeline}
+      , source{source}
+      , metrics{metrics}
+      , started{started}
+      {
+        auto const bus = gst_element_get_bus(pipeline.get());
+        watch = gst_bus_add_watch(bus, &message, this);
+        gst_object_unref(bus);
+        gst_pad_add_probe(this->source.static_pad("src").get(), GST_PAD_PROBE_TYPE_BUFFER, &produced, this, nullptr);
+      }
+
+    PipelineWatch(PipelineWatch const &) = delete;
+    PipelineWatch& operator=(PipelineWatch const &) = delete;
+
+    // handler runs on the main context for every error, before the restart is scheduled
+    void onError(std::function<void()> handler) {
+      error_handlers.push_back(std::move(handler));
+    }
+
+    ~PipelineWatch() {
+      g_source_remove(watch);
+      if (restart_timer) { g_source_remove(restart_timer); }
+    }
+};
+
+
+// Adapts the encoder bitrate to the loss and jitter reported in RTCP receiver reports, with hysteresis:
+// the bitrate backs off multiplicatively as soon as any receiver reports loss or jitter above the high marks,
+// and only climbs back additively after several consecutive clean reports. Between the marks it is left alone.
+// Once the bitrate is at its floor, the quantisation parameter can be raised as a last resort.
+// Changes go through the PropertyWriter like those from the HTTP API, so they are coalesced with them and pushed to /ws.
+class BitrateController {
+  public:
+    struct Bounds {
+      int min_bitrate;
+      int max_bitrate;
+      int max_quantisation_parameter; // 0 to never touch the quantisation parameter
+    };
+
+  private:
+    static constexpr auto interval_ms = 1000;
+    static constexpr auto high_loss = 0.05;
+    static constexpr auto low_loss = 0.01;
+    static constexpr auto high_jitter_ms = 40.0;
+    static constexpr auto clock_rate = 90000.0; // of H.264 RTP timestamps, which jitter is measured in
+    static constexpr auto decrease = 0.75;
+    static constexpr auto clean_reports_to_increase = 3;
+    static constexpr auto quantisation_step = 3;
+    static constexpr auto initial_quantisation_parameter = 25;
+
+    struct Report {
+      double loss = 0;      // fraction of packets lost since the previous report
+      double jitter_ms = 0;
+    };
+
+    Gst::Element rtpbin;
+    PropertiesSchema const & schema;
+    PropertyWriter<Gst::Element>& writer;
+    Bounds bounds;
+
+    // only touched on the web thread
+    std::unordered_map<guint, guint> last_sequence; // highest sequence number each receiver has reported, by SSRC
+    int clean_reports = 0;
+    int quantisation_parameter = 0;
+
+    // The worst report received from any receiver since the last call, if there is one
+    std::optional<Report> newReports() {
+      GObject *session = nullptr;
+      g_signal_emit_by_name(rtpbin.get(), "get-internal-session", 0u, &session);
+      if (!session) { return std::nullopt; }
+
+      GstStructure *stats = nullptr;
+      g_object_get(session, "stats", &stats, nullptr);
+      g_object_unref(session);
+      if (!stats) { return std::nullopt; }
+
+      auto worst = std::optional<Report>{};
+      auto const sources = gst_structure_get_value(stats, "source-stats");
+      auto const array = sources ? static_cast<GValueArray*>(g_value_get_boxed(sources)) : nullptr;
+      for (auto i = 0u; array && i < array->n_values; ++i) {
+        auto const source = gst_value_get_structure(&array->values[i]);
+        auto internal = gboolean{}, have_rb = gboolean{};
+        auto ssrc = guint{}, fraction_lost = guint{}, jitter = guint{}, sequence = guint{};
+        gst_structure_get_boolean(source, "internal", &internal);
+        gst_structure_get_boolean(source, "have-rb", &have_rb);
+        if (internal || !have_rb) { continue; }
+        if (!gst_structure_get_uint(source, "ssrc", &ssrc)
+            || !gst_structure_get_uint(source, "rb-fractionlost", &fraction_lost)
+            || !gst_structure_get_uint(source, "rb-jitter", &jitter)
+            || !gst_structure_get_uint(source, "rb-exthighestseq", &sequence)) {
+          continue;
+        }
+
+        auto [last, inserted] = last_sequence.try_emplace(ssrc, sequence);
+        if (!inserted && last->second == sequence) { continue; }
+        last->second = sequence;
+
+        auto report = worst.value_or(Report{});
+        report.loss = std::max(report.loss, fraction_lost / 256.0);
+        report.jitter_ms = std::max(report.jitter_ms, jitter * 1000 / clock_rate);
+        worst = report;
+      }
+      gst_structure_free(stats);
+      return worst;
+    }
+
+    void add(PropertyAssignments& assignments, char const *name, int value) {
+      auto const entry = schema.find(name);
+      if (!entry || !entry->writable()) { return; }
+
+      auto from = GLib::Value{G_TYPE_INT};
+      g_value_set_int(from.get(), value);
+      auto to = GLib::Value{G_PARAM_SPEC_VALUE_TYPE(entry->property)};
+      if (!g_value_transform(from.get(), to.get())) { return; }
+      g_param_value_validate(entry->property, to.get());
+      assignments.add(name, to.release());
+    }
+
+    void tick() {
+      auto const report = newReports();
+      if (!report) { return; }
+
+      auto const entry = schema.find("bitrate");
+      if (!entry) { return; }
+      auto const current_value = entry->handle.copy();
+      auto current = GLib::Value{G_TYPE_INT};
+      g_value_transform(current_value.get(), current.get());
+      auto const bitrate = std::clamp(g_value_get_int(current.get()), bounds.min_bitrate, bounds.max_bitrate);
+
+      auto target = bitrate;
+      auto target_quantisation = quantisation_parameter;
+      if (report->loss > high_loss || report->jitter_ms > high_jitter_ms) {
+        clean_reports = 0;
+        target = std::max(bounds.min_bitrate, int(bitrate * decrease));
+        if (bitrate == bounds.min_bitrate && bounds.max_quantisation_parameter) {
+          target_quantisation = quantisation_parameter
+            ? std::min(bounds.max_quantisation_parameter, quantisation_parameter + quantisation_step)
+            : std::min(bounds.max_quantisation_parameter, initial_quantisation_parameter);
+        }
+      } else if (report->loss < low_loss && ++clean_reports >= clean_reports_to_increase) {
+        clean_reports = 0;
+        if (quantisation_parameter) {
+          target_quantisation = quantisation_parameter - quantisation_step < initial_quantisation_parameter ? 0 : quantisation_parameter - quantisation_step;
+        } else {
+          target = std::min(bounds.max_bitrate, bitrate + (bounds.max_bitrate - bounds.min_bitrate) / 20);
+        }
+      } else if (report->loss >= low_loss) {
+        clean_reports = 0;
+      }
+
+      auto assignments = PropertyAssignments{};
+      if (target != g_value_get_int(current.get())) {
+        add(assignments, "bitrate", target);
+      }
+      if (target_quantisation != quantisation_parameter) {
+        add(assignments, "quantisation-parameter", target_quantisation);
+        quantisation_parameter = target_quantisation;
+      }
+      if (assignments.empty()) { return; }
+
+      g_message
+        ( "Receivers report %.1f%% loss and %.1f ms jitter, bitrate %d -> %d, quantisation parameter %d"
+        , report->loss * 100, report->jitter_ms, bitrate, target, quantisation_parameter
+        );
+      writer.write(std::move(assignments));
+    }
+
+  public:
+    BitrateController(Gst::Element rtpbin, PropertiesSchema const & schema, PropertyWriter<Gst::Element>& writer, Bounds bounds)
+      : rtpbin{rtpbin}
+      , schema{schema}
+      , writer{writer}
+      , bounds{bounds}
+      {}
+
+    BitrateController(BitrateController const &) = delete;
+    BitrateController& operator=(BitrateController const &) = delete;
+
+    // Runs the controller on a timer of the loop of the calling thread, which must be the web thread as that is where the writer is fed from
+    void attach() {
+      auto const timer = us_create_timer(reinterpret_cast<us_loop_t*>(uWS::Loop::get()), 0, sizeof(BitrateController*));
+      *static_cast<BitrateController**>(us_timer_ext(timer)) = this;
+      us_timer_set
+        ( timer
+        , [] (us_timer_t *timer) { (*static_cast<BitrateController**>(us_timer_ext(timer)))->tick(); }
+        , interval_ms
+        , interval_ms
+        );
+    }
+};
+
+// Makes a queue drop the rest of a GOP rather than single frames when it overflows. The queue leaks upstream, so the frames it
+// already holds stay decodable, and once it has had to refuse a frame every delta frame after it is dropped until the next keyframe.
+class GopDropper {
+  private:
+    std::atomic<bool> dropping = false;
+    std::atomic<std::uint64_t>& dropped;
+
+    static void overrun(GstElement *, gpointer data) {
+      static_cast<GopDropper*>(data)->dropping.store(true, std::memory_order_relaxed);
+    }
+
+    static GstPadProbeReturn probe(GstPad *, GstPadProbeInfo *info, gpointer data) {
+      auto& self = *static_cast<GopDropper*>(data);
+      if (!GST_BUFFER_FLAG_IS_SET(GST_PAD_PROBE_INFO_BUFFER(info), GST_BUFFER_FLAG_DELTA_UNIT)) {
+        self.dropping.store(false, std::memory_order_relaxed);
+        return GST_PAD_PROBE_OK;
+      }
+      if (!self.dropping.load(std::memory_order_relaxed)) { return GST_PAD_PROBE_OK; }
+
+      self.dropped.fetch_add(1, std::memory_order_relaxed);
+      return GST_PAD_PROBE_DROP;
+    }
+
+  public:
+    // dropped counts the frames dropped on top of those the queue refuses itself
+    GopDropper(Gst::Element& queue, std::atomic<std::uint64_t>& dropped) : dropped{dropped} {
+      queue.set_from_string("leaky", "upstream");
+      queue.connect("overrun", G_CALLBACK(&overrun), this);
+      gst_pad_add_probe(queue.static_pad("sink").get(), GST_PAD_PROBE_TYPE_BUFFER, &probe, this, nullptr);
+    }
+
+    GopDropper(GopDropper const &) = delete;
+    GopDropper& operator=(GopDropper const &) = delete;
+};
+
+// Pins the streaming threads of some elements to CPUs. An element announces each streaming thread it starts with a stream status
+// message, which a sync handler receives on that new thread itself. For a queue, that is the thread pushing out of it.
+class ThreadAffinity {
+  private:
+    std::vector<std::pair<std::string, int>> pins;
+
+    static GstBusSyncReply message(GstBus *, GstMessage *message, gpointer data) {
+      if (GST_MESSAGE_TYPE(message) != GST_MESSAGE_STREAM_STATUS) { return GST_BUS_PASS; }
+
+      auto type = GstStreamStatusType{};
+      GstElement *owner = nullptr;
+      gst_message_parse_stream_status(message, &type, &owner);
+      if (type != GST_STREAM_STATUS_TYPE_ENTER || !owner) { return GST_BUS_PASS; }
+
+      for (auto const & [element, cpu] : static_cast<ThreadAffinity*>(data)->pins) {
+        if (element != GST_OBJECT_NAME(owner)) { continue; }
+
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (auto const error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) {
+          g_warning("Failed to pin the streaming thread of %s to CPU %d: %s", element.c_str(), cpu, g_strerror(error));
+        }
+      }
+      return GST_BUS_PASS;
+    }
+
+  public:
+    ThreadAffinity(Gst::Element const & pipeline, std::vector<std::pair<std::string, int>> pins) : pins{std::move(pins)} {
+      if (this->pins.empty()) { return; }
+      auto const bus = gst_element_get_bus(pipeline.get());
+      gst_bus_set_sync_handler(bus, &message, this, nullptr);
+      gst_object_unref(bus);
+    }
+
+    ThreadAffinity(ThreadAffinity const &) = delete;
+    ThreadAffinity& operator=(ThreadAffinity const &) = delete;
+};
+
+// Serves /snapshot.jpg from a branch that decodes keyframes and re-encodes them as JPEG, both in hardware.
+// Nothing flows into the branch until a request needs a fresh still: then keyframes are let through until a JPEG comes out
+// (hardware decoders may hold on to the first few), and every request waiting by then is answered with that one JPEG. JPEGs younger than max_age are served from the cache.
+// The branch sits behind a leaky queue, so the H.264 stream never waits on it.
+class Snapshot {
+  private:
+    static constexpr auto max_age = gint64{1000000}; // µs
+    static constexpr auto timeout = gint64{5000000}; // µs, a few keyframe intervals
+    static constexpr auto watchdog_interval_ms = 1000;
+
+    using Response = uWS::HttpResponse<false>;
+
+    // A request waiting for a fresh still, timed in route from since until it is answered
+    struct Pending {
+      Response *res;
+      Metrics::Route *route;
+      gint64 since;
+    };
+
+    Gst::Element appsink;
+    std::atomic<bool> wanted = false;
+    std::atomic<uWS::Loop*> loop = nullptr;
+
+    // only touched on the web thread
+    std::string jpeg;
+    gint64 captured = 0;          // monotonic
+    std::string last_modified;   // HTTP date of the capture
+    std::vector<Pending> pending;
+
+    static GstPadProbeReturn gate(GstPad *, GstPadProbeInfo *info, gpointer data) {
+      auto& self = *static_cast<Snapshot*>(data);
+      if (!self.wanted.load(std::memory_order_relaxed)) { return GST_PAD_PROBE_DROP; }
+      if (GST_BUFFER_FLAG_IS_SET(GST_PAD_PROBE_INFO_BUFFER(info), GST_BUFFER_FLAG_DELTA_UNIT)) { return GST_PAD_PROBE_DROP; }
+      return GST_PAD_PROBE_OK;
+    }
+
+    static GstFlowReturn new_sample(GstAppSink *appsink, gpointer data) {
+      auto& self = *static_cast<Snapshot*>(data);
+
+      auto const sample = gst_app_sink_pull_sample(appsink);
+      if (!sample) { return GST_FLOW_OK; }
+
+      auto const loop = self.loop.load(std::memory_order_acquire);
+      if (!loop) {
+        gst_sample_unref(sample);
+        return GST_FLOW_OK;
+      }
+      loop->defer
+        ( [&self, sample] () {
+            self.store(gst_sample_get_buffer(sample));
+            gst_sample_unref(sample);
+          }
+        );
+      return GST_FLOW_OK;
+    }
+
+    void store(GstBuffer *buffer) {
+      auto map = GstMapInfo GST_MAP_INFO_INIT;
+      if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) { return; }
+      jpeg.assign(reinterpret_cast<char const *>(map.data), map.size);
+      gst_buffer_unmap(buffer, &map);
+
+      wanted.store(false, std::memory_order_relaxed);
+      captured = g_get_monotonic_time();
+      auto const now = std::time(nullptr);
+      auto time = std::tm{};
+      gmtime_r(&now, &time);
+      char date[64];
+      last_modified.assign(date, std::strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &time));
+
+      for (auto const & request : std::exchange(pending, {})) {
+        respond(request.res);
+        request.route->record(request.since);
+      }
+    }
+
+    void respond(Response *res) {
+      res->cork
+        ( [&] () {
+            res->writeHeader("Access-Control-Allow-Origin", "*");
+            res->writeHeader("Content-Type", "image/jpeg");
+            res->writeHeader("Cache-Control", "no-cache");
+            res->writeHeader("Last-Modified", last_modified);
+            res->end(jpeg);
+          }
+        );
+    }
+
+    void expire() {
+      auto const now = g_get_monotonic_time();
+      auto const expired = std::stable_partition(pending.begin(), pending.end(), [&] (Pending const & request) { return now - request.since < timeout; });
+      for (auto it = expired; it != pending.end(); ++it) {
+        it->res->writeStatus("504 Gateway Timeout");
+        it->res->writeHeader("Access-Control-Allow-Origin", "*");
+        it->res->end();
+        it->route->record(it->since);
+      }
+      pending.erase(expired, pending.end());
+      if (pending.empty()) {
+        wanted.store(false, std::memory_order_relaxed);
+      }
+    }
+
+  public:
+    Snapshot(Gst::Element const & queue, Gst::Element appsink) : appsink{appsink} {
+      appsink["caps"] = Gst::caps_value("image/jpeg");
+      appsink["sync"] = false;
+      // Most of the time the branch carries nothing, which must not hold up state changes of the pipeline
+      appsink["async"] = false;
+      appsink["max-buffers"] = 1u;
+      appsink["drop"] = true;
+
+      auto callbacks = GstAppSinkCallbacks{};
+      callbacks.new_sample = &new_sample;
+      gst_app_sink_set_callbacks(GST_APP_SINK(appsink.get()), &callbacks, this, nullptr);
+
+      gst_pad_add_probe(queue.static_pad("sink").get(), GST_PAD_PROBE_TYPE_BUFFER, &gate, this, nullptr);
+    }
+
+    Snapshot(Snapshot const &) = delete;
+    Snapshot& operator=(Snapshot const &) = delete;
+
+    // Only to be called from the web thread. The request is recorded in route once it is answered, which may be after a
+    // keyframe has been decoded and encoded, or when it times out.
+    void get(Response *res, Metrics::Route& route) {
+      auto const start = g_get_monotonic_time();
+      if (!jpeg.empty() && start - captured < max_age) {
+        respond(res);
+        route.record(start);
+        return;
+      }
+
+      pending.push_back({res, &route, start});
+      res->onAborted
+        ( [this, res] () {
+            pending.erase(std::remove_if(pending.begin(), pending.end(), [&] (Pending const & request) { return request.res == res; }), pending.end());
+          }
+        );
+      wanted.store(true, std::memory_order_relaxed);
+    }
+
+    // Must be called from the thread running the web app
+    void attach() {
+      loop.store(uWS::Loop::get(), std::memory_order_release);
+
+      auto const timer = us_create_timer(reinterpret_cast<us_loop_t*>(uWS::Loop::get()), 0, sizeof(Snapshot*));
+      *static_cast<Snapshot**>(us_timer_ext(timer)) = this;
+      us_timer_set
+        ( timer
+        , [] (us_timer_t *timer) { (*static_cast<Snapshot**>(us_timer_ext(timer)))->expire(); }
+        , watchdog_interval_ms
+        , watchdog_interval_ms
+        );
+    }
+};
+
+// Keeps the last few seconds of the encoded stream in memory, and on demand records from there on to disk.
+// A fakesink branch off the tee holds references to the most recent frames in a ring that is allocated up front and always starts
+// at a keyframe, trimmed to whole GOPs so that at least pre_seconds are kept. Starting a recording builds a separate pipeline,
+// appsrc -> h264parse -> splitmuxsink, into which the ring is flushed before live frames follow.
+// The ring is only touched on the branch's streaming thread, behind a leaky queue, so disk writes never hold up the live stream:
+// when the recording pipeline falls more than max_pending_bytes behind, frames are dropped up to the next keyframe.
+class Recorder {
+  public:
+    struct Settings {
+      std::string directory;
+      int pre_seconds;
+      int segment_seconds; // length of each file
+    };
+
+  private:
+    static constexpr auto max_frame_rate = 120; // for sizing the ring
+    static constexpr auto max_pending_bytes = guint64{8 * 1024 * 1024};
+    static constexpr auto write_size = guint{1024 * 1024}; // bytes filesink writes to the card at a time
+
+    Settings settings;
+
+    // only touched on the streaming thread
+    std::vector<GstBuffer*> ring;
+    std::size_t oldest = 0;
+    std::size_t count = 0;
+    GstElement *appsrc = nullptr;
+    bool waiting_for_keyframe = false;
+
+    // handed to the streaming thread by the main context
+    std::atomic<GstElement*> incoming = nullptr;
+    std::atomic<GstElement*> stopping = nullptr; // the appsrc of a session to end
+
+    // for GET /record
+    std::atomic<std::uint64_t> buffered_frames = 0;
+    std::atomic<GstClockTime> buffered_time = 0;
+
+    // The id of the session being recorded, 0 when not recording. Set on the web thread, and cleared there by stop or on the main
+    // context when the session ends by itself; ids are never reused, so a session that ends late cannot clear a newer one.
+    std::atomic<std::uint64_t> active = 0;
+
+    // only touched on the web thread
+    std::uint64_t sessions = 0;
+    std::string location;
+
+    struct Start {
+      Recorder *self;
+      std::string location;
+      std::uint64_t id;
+    };
+
+    struct Session {
+      Recorder *self;
+      Gst::Pipeline pipeline;
+      Gst::Element source;
+      std::uint64_t id;
+    };
+
+    Session *current = nullptr; // only touched on the main context
+
+    GstBuffer * at(std::size_t i) const {
+      return ring[(oldest + i) % ring.size()];
+    }
+
+    static bool keyframe(GstBuffer *buffer) {
+      return !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    }
+
+    void dropOldest() {
+      gst_buffer_unref(ring[oldest]);
+      oldest = (oldest + 1) % ring.size();
+      --count;
+    }
+
+    void insert(GstBuffer *buffer) {
+      if (count == 0 && !keyframe(buffer)) { return; }
+
+      if (count == ring.size()) {
+        dropOldest();
+        while (count > 0 && !keyframe(at(0))) { dropOldest(); }
+        // A single GOP filled the ring, and the ring must start at a keyframe, so it waits for the next one
+        if (count == 0 && !keyframe(buffer)) {
+          buffered_frames.store(0, std::memory_order_relaxed);
+          buffered_time.store(0, std::memory_order_relaxed);
+          return;
+        }
+      }
+      ring[(oldest + count) % ring.size()] = gst_buffer_ref(buffer);
+      ++count;
+
+      // Drop the oldest GOP while the next one still reaches back far enough
+      auto const newest = GST_BUFFER_PTS(buffer);
+      auto const window = GstClockTime(settings.pre_seconds) * GST_SECOND;
+      while (GST_CLOCK_TIME_IS_VALID(newest)) {
+        auto next = std::size_t{1};
+        while (next < count && !keyframe(at(next))) { ++next; }
+        if (next == count || GST_BUFFER_PTS(at(next)) + window > newest) { break; }
+        while (next-- > 0) { dropOldest(); }
+      }
+
+      buffered_frames.store(count, std::memory_order_relaxed);
+      auto const first = GST_BUFFER_PTS(at(0));
+      buffered_time.store(GST_CLOCK_TIME_IS_VALID(first) && GST_CLOCK_TIME_IS_VALID(newest) ? newest - first : 0, std::memory_order_relaxed);
+    }
+
+    void push(GstBuffer *buffer) {
+      if (gst_app_src_get_current_level_bytes(GST_APP_SRC(appsrc)) > max_pending_bytes) {
+        waiting_for_keyframe = true;
+      }
+      if (waiting_for_keyframe) {
+        if (!keyframe(buffer)) { return; }
+        waiting_for_keyframe = false;
+      }
+      gst_app_src_push_buffer(GST_APP_SRC(appsrc), gst_buffer_ref(buffer));
+    }
+
+    void finish() {
+      gst_app_src_end_of_stream(GST_APP_SRC(appsrc));
+      gst_object_unref(std::exchange(appsrc, nullptr));
+    }
+
+    static GstPadProbeReturn probe(GstPad *, GstPadProbeInfo *info, gpointer data) {
+      auto& self = *static_cast<Recorder*>(data);
+      auto const buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+      self.insert(buffer);
+      if (auto const next = self.incoming.exchange(nullptr)) {
+        if (self.appsrc) { self.finish(); }
+        self.appsrc = next;
+        self.waiting_for_keyframe = false;
+        for (auto i = std::size_t{}; i < self.count; ++i) {
+          self.push(self.at(i));
+        }
+      } else if (self.appsrc) {
+        self.push(buffer);
+      }
+      if (auto const target = self.stopping.exchange(nullptr)) {
+        if (target == self.appsrc) { self.finish(); }
+        gst_object_unref(target);
+      }
+      return GST_PAD_PROBE_OK;
+    }
+
+    // Has the streaming thread stop pushing to the appsrc of session, if it still is; on the main context
+    void requestStop(Session& session) {
+      if (auto const previous = stopping.exchange(GST_ELEMENT(gst_object_ref(session.source.get())))) {
+        gst_object_unref(previous);
+      }
+    }
+
+    // A session that failed or finished, on the main context. GET /record shows it as over, and POST /record/start may start another.
+    void ended(Session& session) {
+      if (current == &session) { current = nullptr; }
+      auto id = session.id;
+      active.compare_exchange_strong(id, 0);
+    }
+
+    static gboolean sessionMessage(GstBus *, GstMessage *message, gpointer data) {
+      auto& session = *static_cast<Session*>(data);
+      switch (GST_MESSAGE_TYPE(message)) {
+        case GST_MESSAGE_ERROR: {
+          GError *error = nullptr;
+          gst_message_parse_error(message, &error, nullptr);
+          g_warning("Recording failed: %s", error->message);
+          g_error_free(error);
+          session.self->requestStop(session);
+          break;
+        }
+        case GST_MESSAGE_EOS:
+          g_print("Recording finished\n");
+          break;
+        default:
+          return G_SOURCE_CONTINUE;
+      }
+      session.pipeline.set_state(GST_STATE_NULL);
+      session.self->ended(session);
+      return G_SOURCE_REMOVE; // frees the session
+    }
+
+    static void freeSession(gpointer data) {
+      delete static_cast<Session*>(data);
+    }
+
+    // On the main context
+    static gboolean startSession(gpointer data) {
+      auto& request = *static_cast<Start*>(data);
+      auto& self = *request.self;
+
+      g_mkdir_with_parents(self.settings.directory.c_str(), 0755);
+
+      auto source = Gst::Element{"appsrc", "record_source"};
+      source["caps"] = Gst::caps_value("video/x-h264,stream-format=byte-stream,alignment=au");
+      source.set_from_string("format", "time");
+      source["max-bytes"] = guint64{max_pending_bytes * 2};
+      source["block"] = false;
+
+      auto parse = Gst::Element{"h264parse", "record_parse"};
+
+      auto file = Gst::Element{"filesink", "record_file"};
+      file.set_from_string("buffer-mode", "full");
+      file["buffer-size"] = write_size;
+
+      auto mux = Gst::Element{"splitmuxsink", "record_mux"};
+      mux["location"] = request.location;
+      mux["max-size-time"] = guint64(self.settings.segment_seconds) * GST_SECOND;
+      g_object_set(mux.get(), "sink", file.get(), nullptr);
+
+      auto const session = new Session{&self, Gst::Pipeline{"recording"}, source, request.id};
+      session->pipeline.add(source);
+      session->pipeline.add(parse);
+      session->pipeline.add(mux);
+      Gst::Element::link(source, parse);
+      Gst::Element::link(parse, mux);
+
+      auto const bus = gst_element_get_bus(session->pipeline.get());
+      gst_bus_add_watch_full(bus, G_PRIORITY_DEFAULT, &sessionMessage, session, &freeSession);
+
+      if (session->pipeline.set_state(GST_STATE_PLAYING)) {
+        g_print("Recording to %s\n", request.location.c_str());
+        self.current = session;
+        if (auto const previous = self.incoming.exchange(GST_ELEMENT(gst_object_ref(source.get())))) {
+          gst_object_unref(previous);
+        }
+      } else {
+        g_warning("Could not start recording to %s", request.location.c_str());
+        session->pipeline.set_state(GST_STATE_NULL);
+        self.ended(*session);
+        gst_bus_remove_watch(bus); // frees the session
+      }
+      gst_object_unref(bus);
+      return G_SOURCE_REMOVE;
+    }
+
+    static void freeStart(gpointer data) {
+      delete static_cast<Start*>(data);
+    }
+
+    // On the main context, so it is ordered after the start it stops; a session that failed to start has nothing to stop
+    static gboolean stopSession(gpointer data) {
+      auto& self = *static_cast<Recorder*>(data);
+      if (self.current) { self.requestStop(*self.current); }
+      return G_SOURCE_REMOVE;
+    }
+
+  public:
+    Recorder(Gst::Element sink, Settings settings) : settings{std::move(settings)}, ring(std::size_t(std::max(this->settings.pre_seconds, 1)) * max_frame_rate * 2, nullptr) {
+      sink["sync"] = false;
+      sink["async"] = false;
+      gst_pad_add_probe(sink.static_pad("sink").get(), GST_PAD_PROBE_TYPE_BUFFER, &probe, this, nullptr);
+    }
+
+    Recorder(Recorder const &) = delete;
+    Recorder& operator=(Recorder const &) = delete;
+
+    ~Recorder() {
+      while (count > 0) { dropOldest(); }
+      if (appsrc) { gst_object_unref(appsrc); }
+      if (auto const next = incoming.load()) { gst_object_unref(next); }
+      if (auto const target = stopping.load()) { gst_object_unref(target); }
+    }
+
+    // Only to be called from the web thread, returns false if already recording
+    bool start() {
+      if (active.load()) { return false; }
+      auto const id = ++sessions;
+      active.store(id);
+
+      auto const now = std::time(nullptr);
+      auto time = std::tm{};
+      localtime_r(&now, &time);
+      char name[32];
+      location = settings.directory + "/" + std::string{name, std::strftime(name, sizeof(name), "%Y%m%d-%H%M%S", &time)} + "-%03d.mp4";
+
+      g_idle_add_full(G_PRIORITY_HIGH, &startSession, new Start{this, location, id}, &freeStart);
+      return true;
+    }
+
+    // Only to be called from the web thread, returns false if not recording
+    bool stop() {
+      if (!active.exchange(0)) { return false; }
+      g_idle_add_full(G_PRIORITY_HIGH, &stopSession, this, nullptr);
+      return true;
+    }
+
+    // {"recording":bool,"location":...,"buffered_frames":N,"buffered_seconds":s}, only from the web thread
+    void write(JsonWriter *out) const {
+      auto const recording = active.load() != 0;
+      out->write("{\"recording\":");
+      writeData(out, recording);
+      writeField(out, "location", recording ? location.c_str() : nullptr);
+      writeField(out, "buffered_frames", buffered_frames.load(std::memory_order_relaxed));
+      writeField(out, "buffered_seconds", double(buffered_time.load(std::memory_order_relaxed)) / GST_SECOND);
+      out->write('}');
+    }
+};
+
+// Startup settings: the built in defaults, overridden by the key file given with --config, overridden by the command line.
+// The key file has a [pipeline] group with the keys source, control, caps, clients, shm-socket, port, rtcp-port, min-bitrate,
+// max-bitrate, max-quantisation-parameter, drop-mode, affinity, snapshot-decoder, snapshot-encoder, record-directory,
+// record-pre-seconds, record-segment-seconds, presets-file, secondary-clients, secondary-caps, secondary-bitrate,
+// secondary-decoder, secondary-scaler, secondary-encoder, keyframe-properties, max-property-rate and cameras, plus one group per
+// element named as in the pipeline (rpicamsrc, capsfilter, udp_queue, rtph264pay, udpsink, ...) whose keys are initial properties
+// in gst-launch syntax:
+//   [rpicamsrc]
+//   bitrate=2000000
+//   exposure-mode=night
+// With cameras (or --camera) each camera is configured by a key file of its own, in the same format, that starts from these settings.
+// The port of the control interface is always the one given here.
+class Config {
+  public:
+    struct Property {
+      std::string element;
+      std::string name;
+      std::string value;
+      bool required = true; // false for built in defaults of properties that older GStreamer releases do not have
+    };
+
+    // A gst-launch description of a bin with an H.264 src pad, e.g. for a USB camera, or empty for rpicamsrc
+    std::string source;
+    // The element of the source whose properties are served, by name
+    std::string control = "rpicamsrc";
+    std::string caps = "video/x-h264,width=1280,height=720,framerate=30/1";
+    std::string clients = "192.168.16.61:5000";
+    std::string shm_socket; // empty for no shmsink
+    int port = 9001;
+    // Receiving RTCP on this port enables adaptive bitrate between these bounds, 0 for a fixed bitrate
+    int rtcp_port = 0;
+    int min_bitrate = 250000;
+    int max_bitrate = 4000000;
+    int max_quantisation_parameter = 0; // 0 to leave the quantisation parameter alone
+    // How udp_queue sheds load when the network cannot keep up: single frames, or the rest of the GOP
+    bool drop_gops = false;
+    // Element factories for /snapshot.jpg, empty for no snapshots
+    std::string snapshot_decoder = "v4l2h264dec";
+    std::string snapshot_encoder = "v4l2jpegenc";
+    // Where /record/start writes to, empty for no recording
+    std::string record_directory;
+    int record_pre_seconds = 10;
+    int record_segment_seconds = 300;
+    std::string presets_file = std::string{g_get_user_config_dir()} + "/rpi_cam_control/presets.json";
+    // A second, smaller stream decoded from the first and encoded again, sent to these destinations, empty for none
+    std::string secondary_clients;
+    std::string secondary_caps = "video/x-raw,width=320,height=180,framerate=10/1";
+    int secondary_bitrate = 200000;
+    std::string secondary_decoder = "v4l2h264dec";
+    std::string secondary_scaler = "v4l2convert";
+    std::string secondary_encoder = "v4l2h264enc";
+    // Streaming threads to pin to a CPU, by the name of the element that starts them
+    std::vector<std::pair<std::string, int>> affinity;
+    // Writes from the control interface to any of these properties force a keyframe, so the change shows in the next frame.
+    // Left empty by default, since every forced keyframe costs a burst of bitrate; adaptive bitrate changes never force one.
+    std::vector<std::string> keyframe_properties;
+    // How often each property may be set from the control interface, in Hz, 0 for no limit
+    int max_property_rate = 20;
+    // Cameras by id and key file, none for a single camera configured here
+    std::vector<std::pair<std::string, std::string>> cameras;
+    // Applied in order, so later entries win
+    std::vector<Property> properties =
+      { {"rpicamsrc", "bitrate", "1000000"}
+      , {"rpicamsrc", "keyframe-interval", "30"}
+      , {"rpicamsrc", "preview", "false"}
+      // rpicamsrc puts SPS/PPS in front of every keyframe already, so the payloader need not repeat them. Aggregating those with
+      // the slice that follows into one STAP-A saves two packets per keyframe. The fragments of a large slice go out as one buffer
+      // list, which udpsink sends with a single sendmmsg: see rpi_cam_udp_sends_per_frame.
+      , {"rtph264pay", "mtu", "1400"}
+      , {"rtph264pay", "config-interval", "0"}
+      , {"rtph264pay", "aggregate-mode", "zero-latency", false}
+      // The encoder pushes into udp_queue and never waits on the network: the queue drops frames once it holds more than
+      // 300 ms. send_queue gives udpsink its own thread and holds back the payloader, so drops only ever happen on whole frames.
+      , {"udp_queue", "leaky", "downstream"}
+      , {"udp_queue", "max-size-buffers", "0"}
+      , {"udp_queue", "max-size-bytes", "0"}
+      , {"udp_queue", "max-size-time", "300000000"}
+      , {"send_queue", "max-size-buffers", "0"}
+      , {"send_queue", "max-size-bytes", "0"}
+      , {"send_queue", "max-size-time", "100000000"}
+      };
+
+  private:
+    using Strv = std::unique_ptr<gchar*, void (*)(gchar**)>;
+
+    static void fail(GError **error, std::string const & message) {
+      g_set_error_literal(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE, message.c_str());
+    }
+
+    static bool parseInt(std::string_view key, std::string const & value, int minimum, int maximum, int& out, GError **error) {
+      auto const res = std::from_chars(value.data(), value.data() + value.size(), out);
+      if (res.ec != std::errc{} || res.ptr != value.data() + value.size() || out < minimum || out > maximum) {
+        fail(error, "Invalid " + std::string{key} + " " + value);
+        return false;
+      }
+      return true;
+    }
+
+    bool setDropMode(std::string_view value, GError **error) {
+      if (value != "frames" && value != "gop") {
+        fail(error, "Invalid drop-mode " + std::string{value} + ", expected frames or gop");
+        return false;
+      }
+      drop_gops = value == "gop";
+      return true;
+    }
+
+    // ELEMENT:CPU,...
+    bool setAffinity(std::string_view value, GError **error) {
+      affinity.clear();
+      while (!value.empty()) {
+        auto const end = std::min(value.find(','), value.size());
+        auto const entry = value.substr(0, end);
+        value = value.substr(std::min(end + 1, value.size()));
+
+        auto const colon = entry.rfind(':');
+        auto cpu = 0;
+        if (colon == std::string_view::npos || !parseInt("affinity", std::string{entry.substr(colon + 1)}, 0, CPU_SETSIZE - 1, cpu, error)) {
+          if (colon == std::string_view::npos) { fail(error, "Expected ELEMENT:CPU in affinity, got " + std::string{entry}); }
+          return false;
+        }
+        affinity.emplace_back(entry.substr(0, colon), cpu);
+      }
+      return true;
+    }
+
+    // ID:FILE,...
+    bool setCameras(std::string_view value, GError **error) {
+      cameras.clear();
+      while (!value.empty()) {
+        auto const end = std::min(value.find(','), value.size());
+        if (!addCamera(value.substr(0, end), error)) { return false; }
+        value = value.substr(std::min(end + 1, value.size()));
+      }
+      return true;
+    }
+
+    // ID:FILE, the id being a path segment of the camera's routes
+    bool addCamera(std::string_view entry, GError **error) {
+      auto const colon = entry.find(':');
+      auto const id = entry.substr(0, colon);
+      auto const valid = [] (char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_'; };
+      if (colon == std::string_view::npos || id.empty() || !std::all_of(id.begin(), id.end(), valid) || colon + 1 == entry.size()) {
+        fail(error, "Expected ID:FILE in cameras, the id made of letters, digits, - and _, got " + std::string{entry});
+        return false;
+      }
+      if (std::any_of(cameras.begin(), cameras.end(), [&] (auto const & camera) { return camera.first == id; })) {
+        fail(error, "Camera " + std::string{id} + " is configured twice");
+        return false;
+      }
+      cameras.emplace_back(id, entry.substr(colon + 1));
+      return true;
+    }
+
+    bool setPipeline(std::string_view key, std::string value, GError **error) {
+      if (key == "source") {
+        source = std::move(value);
+      } else if (key == "control") {
+        control = std::move(value);
+      } else if (key == "caps") {
+        caps = std::move(value);
+      } else if (key == "clients") {
+        clients = std::move(value);
+      } else if (key == "shm-socket") {
+        shm_socket = std::move(value);
+      } else if (key == "port") {
+        return parseInt(key, value, 1, 65535, port, error);
+      } else if (key == "rtcp-port") {
+        return parseInt(key, value, 0, 65535, rtcp_port, error);
+      } else if (key == "min-bitrate") {
+        return parseInt(key, value, 1, G_MAXINT, min_bitrate, error);
+      } else if (key == "max-bitrate") {
+        return parseInt(key, value, 1, G_MAXINT, max_bitrate, error);
+      } else if (key == "max-quantisation-parameter") {
+        return parseInt(key, value, 0, 51, max_quantisation_parameter, error);
+      } else if (key == "snapshot-decoder") {
+        snapshot_decoder = std::move(value);
+      } else if (key == "snapshot-encoder") {
+        snapshot_encoder = std::move(value);
+      } else if (key == "record-directory") {
+        record_directory = std::move(value);
+      } else if (key == "record-pre-seconds") {
+        return parseInt(key, value, 0, 600, record_pre_seconds, error);
+      } else if (key == "record-segment-seconds") {
+        return parseInt(key, value, 1, G_MAXINT, record_segment_seconds, error);
+      } else if (key == "presets-file") {
+        presets_file = std::move(value);
+      } else if (key == "secondary-clients") {
+        secondary_clients = std::move(value);
+      } else if (key == "secondary-caps") {
+        secondary_caps = std::move(value);
+      } else if (key == "secondary-bitrate") {
+        return parseInt(key, value, 1, G_MAXINT, secondary_bitrate, error);
+      } else if (key == "secondary-decoder") {
+        secondary_decoder = std::move(value);
+      } else if (key == "secondary-scaler") {
+        secondary_scaler = std::move(value);
+      } else if (key == "secondary-encoder") {
+        secondary_encoder = std::move(value);
+      } else if (key == "drop-mode") {
+        return setDropMode(value, error);
+      } else if (key == "affinity") {
+        return setAffinity(value, error);
+      } else if (key == "cameras") {
+        return setCameras(value, error);
+      } else if (key == "max-property-rate") {
+        return parseInt(key, value, 0, 1000, max_property_rate, error);
+      } else if (key == "keyframe-properties") {
+        keyframe_properties.clear();
+        for (auto rest = std::string_view{value}; !rest.empty(); ) {
+          auto const end = std::min(rest.find(','), rest.size());
+          if (end) { keyframe_properties.emplace_back(rest.substr(0, end)); }
+          rest = rest.substr(std::min(end + 1, rest.size()));
+        }
+      } else {
+        fail(error, "Unknown key " + std::string{key} + " in [pipeline]");
+        return false;
+      }
+      return true;
+    }
+
+    bool loadFile(char const *path, GError **error) {
+      auto const key_file = std::unique_ptr<GKeyFile, void (*)(GKeyFile*)>{g_key_file_new(), g_key_file_free};
+      if (!g_key_file_load_from_file(key_file.get(), path, G_KEY_FILE_NONE, error)) { return false; }
+
+      auto const groups = Strv{g_key_file_get_groups(key_file.get(), nullptr), g_strfreev};
+      for (auto group = groups.get(); *group; ++group) {
+        auto const keys = Strv{g_key_file_get_keys(key_file.get(), *group, nullptr, error), g_strfreev};
+        if (!keys) { return false; }
+
+        for (auto key = keys.get(); *key; ++key) {
+          auto const value = g_key_file_get_string(key_file.get(), *group, *key, error);
+          if (!value) { return false; }
+          auto owned = std::string{value};
+          g_free(value);
+
+          if (std::string_view{*group} == "pipeline") {
+            if (!setPipeline(*key, std::move(owned), error)) { return false; }
+          } else {
+            properties.push_back({*group, *key, std::move(owned)});
+          }
+        }
+      }
+      return true;
+    }
+
+    // ELEMENT.PROPERTY=VALUE
+    bool addProperty(std::string_view assignment, GError **error) {
+      auto const dot = assignment.find('.');
+      auto const equals = assignment.find('=');
+      if (dot == std::string_view::npos || equals == std::string_view::npos || dot > equals) {
+        fail(error, "Expected ELEMENT.PROPERTY=VALUE, got " + std::string{assignment});
+        return false;
+      }
+      properties.push_back
+        ( { std::string{assignment.substr(0, dot)}
+          , std::string{assignment.substr(dot + 1, equals - dot - 1)}
+          , std::string{assignment.substr(equals + 1)}
+          }
+        );
+      return true;
+    }
+
+    bool validate(GError **error) const {
+      for (auto const & [key, value] : {std::pair{"caps", &caps}, std::pair{"secondary-caps", &secondary_caps}}) {
+        auto const parsed = gst_caps_from_string(value->c_str());
+        if (!parsed) {
+          fail(error, "Invalid "s + key + " " + *value);
+          return false;
+        }
+        gst_caps_unref(parsed);
+      }
+      if (!source.empty() && !Gst::Bin::parse(source.c_str(), error)) { return false; }
+      if (min_bitrate > max_bitrate) {
+        fail(error, "min-bitrate is above max-bitrate");
+        return false;
+      }
+      return true;
+    }
+
+    // gst_init rescans the plugin directories on every start to see whether the cached registry is stale, which means reading every
+    // plugin on the SD card. Once a registry is cached it is trusted as is; run once with GST_REGISTRY_UPDATE=yes after
+    // installing or removing plugins. Plugins are still only loaded as their elements are first created.
+    static void lockRegistry() {
+      if (g_getenv("GST_REGISTRY_UPDATE")) { return; }
+
+      auto cached = false;
+      if (auto const path = g_getenv("GST_REGISTRY_1_0") ? g_getenv("GST_REGISTRY_1_0") : g_getenv("GST_REGISTRY")) {
+        cached = g_file_test(path, G_FILE_TEST_IS_REGULAR);
+      } else {
+        auto const directory = g_build_filename(g_get_user_cache_dir(), "gstreamer-1.0", nullptr);
+        if (auto const dir = g_dir_open(directory, 0, nullptr)) {
+          while (auto const name = g_dir_read_name(dir)) {
+            cached = cached || (g_str_has_prefix(name, "registry.") && g_str_has_suffix(name, ".bin"));
+          }
+          g_dir_close(dir);
+        }
+        g_free(directory);
+      }
+      if (cached) {
+        g_setenv("GST_REGISTRY_UPDATE", "no", FALSE);
+      }
+    }
+
+  public:
+    // Also initialises GStreamer. Prints what is wrong and returns nothing if the command line or key file is invalid.
+    static std::optional<Config> load(int& argc, char **& argv) {
+      gchar *config_file = nullptr;
+      gchar *caps = nullptr;
+      gchar *clients = nullptr;
+      gchar *shm_socket = nullptr;
+      gint port = 0;
+      gint rtcp_port = 0;
+      gchar *drop_mode = nullptr;
+      gchar *affinity = nullptr;
+      gchar *record_directory = nullptr;
+      gchar *secondary_clients = nullptr;
+      gchar **set = nullptr;
+      gchar **cameras = nullptr;
+      GOptionEntry const options[] =
+        { { "config", 'f', 0, G_OPTION_ARG_FILENAME, &config_file, "Read settings and initial element properties from the key file FILE", "FILE" }
+        , { "caps", 0, 0, G_OPTION_ARG_STRING, &caps, "Caps of the encoded stream (default video/x-h264,width=1280,height=720,framerate=30/1)", "CAPS" }
+        , { "clients", 'c', 0, G_OPTION_ARG_STRING, &clients, "Comma separated destinations of the RTP stream (default 192.168.16.61:5000)", "HOST:PORT,..." }
+        , { "shm-socket", 0, 0, G_OPTION_ARG_FILENAME, &shm_socket, "Also share the encoded stream with local processes through a shmsink control socket at PATH", "PATH" }
+        , { "port", 'p', 0, G_OPTION_ARG_INT, &port, "Port of the control interface (default 9001)", "PORT" }
+        , { "rtcp-port", 0, 0, G_OPTION_ARG_INT, &rtcp_port, "Receive RTCP receiver reports on PORT and adapt the bitrate to them", "PORT" }
+        , { "drop-mode", 0, 0, G_OPTION_ARG_STRING, &drop_mode, "Drop single frames or the rest of the GOP when the network falls behind (default frames)", "frames|gop" }
+        , { "affinity", 0, 0, G_OPTION_ARG_STRING, &affinity, "Pin the streaming threads of elements to CPUs", "ELEMENT:CPU,..." }
+        , { "record-directory", 0, 0, G_OPTION_ARG_FILENAME, &record_directory, "Enable /record/start, writing recordings to DIR", "DIR" }
+        , { "secondary-clients", 0, 0, G_OPTION_ARG_STRING, &secondary_clients, "Also send a low resolution stream, see secondary-caps, to these destinations", "HOST:PORT,..." }
+        , { "set", 's', 0, G_OPTION_ARG_STRING_ARRAY, &set, "Set an initial element property, may be repeated", "ELEMENT.PROPERTY=VALUE" }
+        , { "camera", 0, 0, G_OPTION_ARG_STRING_ARRAY, &cameras, "Add a camera configured by the key file FILE, served under /cams/ID, may be repeated", "ID:FILE" }
+        , {}
+        };
+
+      auto context = std::unique_ptr<GOptionContext, void (*)(GOptionContext*)>{g_option_context_new("- stream and control the Raspberry Pi camera"), g_option_context_free};
+      g_option_context_add_main_entries(context.get(), options, nullptr);
+      g_option_context_add_group(context.get(), gst_init_get_option_group());
+
+      lockRegistry();
+      auto config = Config{};
+      GError *error = nullptr;
+      auto ok = g_option_context_parse(context.get(), &argc, &argv, &error)
+        && (!config_file || config.loadFile(config_file, &error));
+      if (ok) {
+        if (caps) { config.caps = caps; }
+        if (clients) { config.clients = clients; }
+        if (shm_socket) { config.shm_socket = shm_socket; }
+        if (port) { config.port = port; }
+        if (rtcp_port) { config.rtcp_port = rtcp_port; }
+        if (record_directory) { config.record_directory = record_directory; }
+        if (secondary_clients) { config.secondary_clients = secondary_clients; }
+        ok = (!drop_mode || config.setDropMode(drop_mode, &error)) && (!affinity || config.setAffinity(affinity, &error));
+        for (auto assignment = set; ok && assignment && *assignment; ++assignment) {
+          ok = config.addProperty(*assignment, &error);
+        }
+        for (auto camera = cameras; ok && camera && *camera; ++camera) {
+          ok = config.addCamera(*camera, &error);
+        }
+      }
+      ok = ok && config.validate(&error);
+
+      g_free(config_file);
+      g_free(caps);
+      g_free(clients);
+      g_free(shm_socket);
+      g_free(drop_mode);
+      g_free(affinity);
+      g_free(record_directory);
+      g_free(secondary_clients);
+      g_strfreev(set);
+      g_strfreev(cameras);
+
+      if (!ok) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return std::nullopt;
+      }
+      return config;
+    }
+
+    // The settings of one of cameras: these, overridden by its key file. Each camera keeps its presets in a file of its own.
+    // Prints what is wrong and returns nothing if the key file is invalid.
+    std::optional<Config> camera(std::pair<std::string, std::string> const & camera) const {
+      auto config = *this;
+      config.cameras.clear();
+      auto const directory = g_path_get_dirname(presets_file.c_str());
+      config.presets_file = std::string{directory} + "/presets-" + camera.first + ".json";
+      g_free(directory);
+
+      GError *error = nullptr;
+      if (!config.loadFile(camera.second.c_str(), &error) || !config.validate(&error)) {
+        g_printerr("%s: %s\n", camera.second.c_str(), error->message);
+        g_error_free(error);
+        return std::nullopt;
+      }
+      config.port = port;
+      return config;
+    }
+
+    // Sets the initial properties on the elements of pipeline, warning about any that do not exist
+    void apply(Gst::Bin& pipeline) const {
+      for (auto const & property : properties) {
+        auto const element = std::unique_ptr<GstElement, void (*)(gpointer)>{gst_bin_get_by_name(GST_BIN(pipeline.get()), property.element.c_str()), gst_object_unref};
+        if (!element) {
+          g_warning("No element %s to set %s on", property.element.c_str(), property.name.c_str());
+          continue;
+        }
+        if (!g_object_class_find_property(G_OBJECT_GET_CLASS(element.get()), property.name.c_str())) {
+          if (!property.required) { continue; }
+          g_warning("%s has no property %s", property.element.c_str(), property.name.c_str());
+          continue;
+        }
+        gst_util_set_object_arg(G_OBJECT(element.get()), property.name.c_str(), property.value.c_str());
+      }
+    }
+};
+
+// The caps between the camera and the rest of the pipeline, behind GET and POST /pipeline.
+// rpicamsrc only configures the sensor and encoder as it starts, so a change takes the pipeline down to READY and back to PLAYING
+// on the main context. Streaming pauses briefly but every consumer stays connected.
+// rpicamsrc is live, so caps it cannot produce only fail once it starts streaming, as an error on the bus. New caps are therefore on
+// trial until a buffer has passed the capsfilter, and an error during the trial puts back the last caps that did stream, before
+// the PipelineWatch restarts the pipeline.
+class StreamCaps {
+  private:
+    Gst::Element pipeline;
+    Gst::Element capsfilter;
+    GLib::Property caps; // only read from the web thread
+    std::unique_ptr<GstCaps, void (*)(GstCaps*)> allowed;
+    GLib::Value good{GST_TYPE_CAPS}; // the caps before the ones on trial, only touched on the main context
+    std::atomic<bool> trial = false;
+
+    struct Change {
+      StreamCaps *self;
+      GstCaps *caps;
+    };
+
+    static gboolean apply(gpointer data) {
+      auto const change = static_cast<Change*>(data);
+      auto& self = *change->self;
+
+      // Caps still on trial never streamed, so the ones before them stay the good ones
+      if (!self.trial.load(std::memory_order_acquire)) {
+        g_object_get_property(G_OBJECT(self.capsfilter.get()), "caps", self.good.get());
+      }
+
+      self.pipeline.set_state(GST_STATE_READY);
+      g_object_set(self.capsfilter.get(), "caps", change->caps, nullptr);
+      if (!self.trial.exchange(true, std::memory_order_acq_rel)) {
+        gst_pad_add_probe(self.capsfilter.static_pad("src").get(), GST_PAD_PROBE_TYPE_BUFFER, &streamed, &self, nullptr);
+      }
+      if (!self.pipeline.set_state(GST_STATE_PLAYING)) {
+        self.revert();
+        self.pipeline.set_state(GST_STATE_READY);
+        self.pipeline.set_state(GST_STATE_PLAYING);
+      }
+      return G_SOURCE_REMOVE;
+    }
+
+    // The first buffer through the capsfilter ends the trial, on the streaming thread
+    static GstPadProbeReturn streamed(GstPad *, GstPadProbeInfo *, gpointer data) {
+      static_cast<StreamCaps*>(data)->trial.store(false, std::memory_order_release);
+      return GST_PAD_PROBE_REMOVE;
+    }
+
+    static void freeChange(gpointer data) {
+      auto const change = static_cast<Change*>(data);
+      gst_caps_unref(change->caps);
+      delete change;
+    }
+
+  public:
+    StreamCaps(Gst::Element pipeline, Gst::Element capsfilter, Gst::Element source)
+      : pipeline{pipeline}
+      , capsfilter{capsfilter}
+      , caps{capsfilter["caps"]}
+      , allowed{gst_pad_get_pad_template_caps(source.static_pad("src").get()), gst_caps_unref}
+      {}
+
+    StreamCaps(StreamCaps const &) = delete;
+    StreamCaps& operator=(StreamCaps const &) = delete;
+
+    void write(JsonWriter *out) {
+      auto const current = caps.copy();
+      auto const value = gst_value_get_caps(current.get());
+      auto const text = value ? gst_caps_to_string(value) : nullptr;
+      out->write("{\"caps\":");
+      writeData(out, text);
+      g_free(text);
+
+      if (value && !gst_caps_is_empty(value)) {
+        auto const structure = gst_caps_get_structure(value, 0);
+        auto width = gint{}, height = gint{}, numerator = gint{}, denominator = gint{};
+        if (gst_structure_get_int(structure, "width", &width)) { writeField(out, "width", width); }
+        if (gst_structure_get_int(structure, "height", &height)) { writeField(out, "height", height); }
+        if (gst_structure_get_fraction(structure, "framerate", &numerator, &denominator)) {
+          out->write(",\"framerate\":[");
+          writeData(out, numerator);
+          out->write(',');
+          writeData(out, denominator);
+          out->write(']');
+        }
+      }
+      out->write('}');
+    }
+
+    // Takes {"caps": "..."} to replace the caps outright, or any of width, height and framerate ("30/1" or [30,1]) to change just those
+    std::unique_ptr<GstCaps, void (*)(GstCaps*)> parse(std::string_view json) {
+      using Kind = JsonParser::Value::Kind;
+
+      auto const current = caps.copy();
+      auto result = std::unique_ptr<GstCaps, void (*)(GstCaps*)>{gst_caps_copy(gst_value_get_caps(current.get())), gst_caps_unref};
+
+      auto const integer = [] (std::string_view key, JsonParser::Value const & value) {
+          auto result = gint{};
+          auto const res = std::from_chars(value.raw.begin(), value.raw.end(), result);
+          if (value.kind != Kind::number || res.ec != std::errc{} || res.ptr != value.raw.end() || result <= 0) {
+            throw bad_request{"Invalid "s + std::string{key} + ": " + std::string{value.raw}};
+          }
+          return result;
+        };
+
+      auto parser = JsonParser{json};
+      parser.object
+        ( [&] (std::string_view key, JsonParser::Value value) {
+            if (key == "caps" && value.kind == Kind::string) {
+              auto const parsed = gst_caps_from_string(value.text().c_str());
+              if (!parsed) { throw bad_request{"Invalid caps: " + value.text()}; }
+              result.reset(parsed);
+            } else if (key == "width" || key == "height") {
+              gst_caps_set_simple(result.get(), std::string{key}.c_str(), G_TYPE_INT, integer(key, value), nullptr);
+            } else if (key == "framerate") {
+              auto parts = std::array<gint, 2>{};
+              if (value.kind == Kind::array) {
+                auto count = std::size_t{};
+                auto inner = JsonParser{value.raw};
+                inner.array
+                  ( [&] (JsonParser& parser) {
+                      auto const part = parser.value();
+                      if (count == parts.size()) { throw bad_request{"Invalid framerate"}; }
+                      parts[count++] = integer(key, part);
+                    }
+                  );
+                if (count != parts.size()) { throw bad_request{"Invalid framerate"}; }
+              } else if (value.kind == Kind::string && !value.escaped && value.raw.find('/') != std::string_view::npos) {
+                auto const slash = value.raw.find('/');
+                parts[0] = integer(key, JsonParser::Value{Kind::number, value.raw.substr(0, slash)});
+                parts[1] = integer(key, JsonParser::Value{Kind::number, value.raw.substr(slash + 1)});
+              } else {
+                throw bad_request{"Invalid framerate: " + std::string{value.raw}};
+              }
+              gst_caps_set_simple(result.get(), "framerate", GST_TYPE_FRACTION, parts[0], parts[1], nullptr);
+            } else {
+              throw bad_request{"Unexpected field " + std::string{key}};
+            }
+          }
+        );
+      parser.finish();
+
+      // Only rules out caps the source can never produce; whether the camera can run them is only known once it tries
+      if (!gst_caps_can_intersect(result.get(), allowed.get())) { throw bad_request{"The camera does not support these caps"}; }
+      return result;
+    }
+
+    // Puts back the last caps that streamed if the ones on trial have not, for the PipelineWatch to call on an error.
+    // Must be called on the main context.
+    void revert() {
+      if (!trial.exchange(false, std::memory_order_acq_rel)) { return; }
+      g_warning("Could not negotiate new caps, reverting");
+      g_object_set_property(G_OBJECT(capsfilter.get()), "caps", good.get());
+    }
+
+    // Callable from any thread
+    void set(std::unique_ptr<GstCaps, void (*)(GstCaps*)> caps) {
+      g_idle_add_full(G_PRIORITY_HIGH, &apply, new Change{this, caps.release()}, &freeChange);
+    }
+};
+
+// Builds the routes of the control interface, each timed in the metrics of the camera it belongs to. Only used on the web thread.
+class Routes {
+  private:
+    using Response = uWS::HttpResponse<false>;
+
+    JsonWriter json;
+
+  public:
+    uWS::App& app;
+
+    explicit Routes(uWS::App& app) : app{app} {}
+
+    Routes(Routes const &) = delete;
+    Routes& operator=(Routes const &) = delete;
+
+    template <typename Handler>
+    static auto timed(Metrics::Route& route, Handler handler) {
+      return [&route, handler] (Response *res, uWS::HttpRequest *req) {
+          auto const start = g_get_monotonic_time();
+          handler(res, req);
+          route.record(start);
+        };
+    }
+
+    static void cors_preflight(Response *res, uWS::HttpRequest *) {
+      res->writeHeader("Access-Control-Allow-Headers", "*");
+      res->writeHeader("Access-Control-Allow-Methods", "*");
+      res->writeHeader("Access-Control-Allow-Origin", "*");
+      res->end();
+    }
+
+    // The answer to a POST whose outcome is only known later, dropped if the client has gone away by then
+    class Reply {
+      private:
+        Response *res;
+        Metrics::Route *route;
+        gint64 start;
+        std::shared_ptr<bool> aborted = std::make_shared<bool>(false);
+
+      public:
+        Reply(Response *res, Metrics::Route& route, gint64 start) : res{res}, route{&route}, start{start} {
+          res->onAborted([aborted = aborted] () { *aborted = true; });
+        }
+
+        void operator()(std::string_view status, std::string_view body = {}) const {
+          if (*aborted) { return; }
+          res->cork
+            ( [&] () {
+                res->writeStatus(status);
+                res->writeHeader("Access-Control-Allow-Origin", "*");
+                if (!body.empty()) {
+                  res->writeHeader("Content-Type", "application/json");
+                }
+                res->end(body);
+              }
+            );
+          route->record(start);
+        }
+    };
+
+    // Answers a GET with what write puts in the buffer
+    template <typename Write>
+    void get(Metrics& metrics, std::string const & pattern, Write write, std::string_view content_type = "application/json") {
+      app.get
+        ( pattern
+        , timed
+          ( metrics.route(pattern)
+          , [&json = json, write, content_type] (Response *res, uWS::HttpRequest *) {
+              res->cork
+                ( [&] () {
+                    res->writeHeader("Access-Control-Allow-Origin", "*");
+                    res->writeHeader("Content-Type", content_type);
+
+                    json.clear();
+                    write(&json);
+                    res->end(json.view());
+                  }
+                );
+            }
+          )
+        );
+    }
+
+    // Reads the whole body of a POST and answers with the status handle returns for it, or 400 if it throws bad_request.
+    // A handle that takes a Reply answers through it instead, whenever it is ready to.
+    template <typename Handle>
+    void post(Metrics& metrics, std::string const & pattern, Handle handle) {
+      app.options(pattern, cors_preflight);
+      app.post
+        ( pattern
+        , [handle, &route = metrics.route(pattern)] (Response *res, uWS::HttpRequest *req) {
+            res->onAborted([] () {});
+            res->onData
+              ( [handle, res, &route, start = g_get_monotonic_time(), parameter = std::string{req->getParameter(0)}, body = RequestBody{}] (std::string_view data, bool fin) mutable {
+                  auto const json = body.append(data, fin);
+                  if (!json) { return; }
+
+                  auto const respond = [&] (std::string_view status, std::string_view message = {}) {
+                      res->writeStatus(status);
+                      res->writeHeader("Access-Control-Allow-Origin", "*");
+                      res->end(message);
+                      route.record(start);
+                    };
+
+                  if (body.overflowed()) {
+                    respond("413 Payload Too Large");
+                    return;
+                  }
+                  try {
+                    // Routes with a parameter get it as a second argument
+                    if constexpr (std::is_invocable_v<decltype(handle), std::string_view, Reply>) {
+                      handle(*json, Reply{res, route, start});
+                    } else if constexpr (std::is_invocable_v<decltype(handle), std::string_view, std::string_view, Reply>) {
+                      handle(*json, parameter, Reply{res, route, start});
+                    } else if constexpr (std::is_invocable_v<decltype(handle), std::string_view, std::string_view>) {
+                      respond(handle(*json, parameter));
+                    } else {
+                      respond(handle(*json));
+                    }
+                  } catch (bad_request const & e) {
+                    respond("400 Bad Request", e.what());
+                  }
+                }
+              );
+          }
+        );
+    }
+
+    // Answers a DELETE with 204 if remove finds what the parameters name, 404 if not, or 400 if it throws bad_request
+    template <typename Remove>
+    void del(Metrics& metrics, std::string const & pattern, Remove remove) {
+      app.del
+        ( pattern
+        , timed
+          ( metrics.route(pattern)
+          , [remove] (Response *res, uWS::HttpRequest *req) {
+              try {
+                auto const found = remove(req);
+                res->writeStatus(found ? "204 No Content" : "404 Not Found");
+                res->writeHeader("Access-Control-Allow-Origin", "*");
+                res->end();
+              } catch (bad_request const & e) {
+                res->writeStatus("400 Bad Request");
+                res->writeHeader("Access-Control-Allow-Origin", "*");
+                res->end(e.what());
+              }
+            }
+          )
+        );
+    }
+};
+
+// GET /debug/profile?seconds=N[&format=chrome] times every element of the pipeline and every request to the camera's routes for
+// N seconds (1 to 60, 5 by default). It then answers with a summary per element and route, or with every sample as a Chrome trace for
+// chrome://tracing or Perfetto. GStreamer only reads GST_TRACERS at startup, so the pad probes here stand in for its proctime,
+// queuelevel and interlatency tracers. They are only installed while a profile runs, and cost nothing otherwise.
+// Only used on the web thread, apart from the probes.
+class Profiler {
+  public:
+    struct Options {
+      gint64 seconds = 5;
+      bool chrome = false;
+    };
+
+    // Throws bad_request for a duration out of range or an unknown format
+    static Options parse(uWS::HttpRequest *req) {
+      auto options = Options{};
+      if (auto const seconds = req->getQuery("seconds"); !seconds.empty()) {
+        auto const res = std::from_chars(seconds.data(), seconds.data() + seconds.size(), options.seconds);
+        if (res.ec != std::errc{} || res.ptr != seconds.data() + seconds.size() || options.seconds < 1 || options.seconds > 60) {
+          throw bad_request{"seconds must be from 1 to 60"};
+        }
+      }
+      if (auto const format = req->getQuery("format"); !format.empty()) {
+        if (format != "json" && format != "chrome") { throw bad_request{"format must be json or chrome"}; }
+        options.chrome = format == "chrome";
+      }
+      return options;
+    }
+
+  private:
+    static constexpr auto max_events = std::size_t{200000};
+    static constexpr auto max_arrivals = std::size_t{64};
+
+    struct Session;
+
+    // The samples of one element, taken on streaming threads under the mutex
+    struct Stage {
+      std::string name;
+      std::string factory;
+      GstElement *element;
+      bool queue; // reports its fill level
+      bool filter = false; // has both sink and src pads, so the time between them can be measured
+      std::mutex mutex;
+      std::deque<std::pair<GstClockTime, gint64>> arrivals; // PTS and arrival time of buffers that have not come out yet
+      LatencyHistogram processing; // µs from sink pad to src pad
+      LatencyHistogram interval; // µs between buffers coming out
+      std::uint64_t buffers = 0;
+      std::uint64_t bytes = 0;
+      gint64 last_out = 0;
+      std::uint64_t level_samples = 0;
+      std::uint64_t level_sum = 0;
+      guint level_max = 0;
+
+      Stage(GstElement *element)
+        : name{GST_OBJECT_NAME(element)}
+        , factory{gst_element_get_factory(element) ? GST_OBJECT_NAME(gst_element_get_factory(element)) : ""}
+        , element{element}
+        , queue{g_object_class_find_property(G_OBJECT_GET_CLASS(element), "current-level-buffers") != nullptr}
+        {}
+    };
+
+    // A span of an element or handler, or the level of a queue, for the Chrome trace
+    struct Event {
+      char phase; // 'X' for a span, 'C' for a level
+      std::string_view name;
+      std::size_t thread;
+      gint64 time; // µs since the start of the profile
+      gint64 value; // the duration in µs, or the level in buffers
+    };
+
+    struct Route {
+      Metrics::Route *route;
+      std::vector<Metrics::Route::Span> spans;
+    };
+
+    struct Session {
+      Options options;
+      gint64 const start = g_get_monotonic_time();
+      std::deque<Stage> stages;
+      std::deque<Route> routes;
+      std::mutex trace_mutex;
+      std::vector<Event> events;
+      std::uint64_t dropped = 0;
+      std::vector<std::pair<pthread_t, std::string>> threads; // the index is the thread's id in the trace
+
+      explicit Session(Options options) : options{options} {}
+
+      // Must be called with trace_mutex held
+      std::size_t thread() {
+        auto const self = pthread_self();
+        for (auto i = std::size_t{}; i < threads.size(); ++i) {
+          if (pthread_equal(threads[i].first, self)) { return i; }
+        }
+        char name[16] = {};
+        pthread_getname_np(self, name, sizeof(name));
+        threads.emplace_back(self, name);
+        return threads.size() - 1;
+      }
+
+      void trace(char phase, std::string_view name, gint64 time, gint64 value) {
+        if (!options.chrome) { return; }
+        auto const lock = std::lock_guard{trace_mutex};
+        if (events.size() == max_events) {
+          ++dropped;
+          return;
+        }
+        events.push_back(Event{phase, name, thread(), time - start, value});
+      }
+    };
+
+    // What a probe gets as its data, keeping the session alive until GStreamer is done with the probe
+    struct Probe {
+      std::shared_ptr<Session> session;
+      Stage *stage;
+    };
+
+    Gst::Element pipeline;
+    Metrics& metrics;
+    std::shared_ptr<Session> session;
+    std::optional<Routes::Reply> reply;
+    std::vector<std::pair<GstPad*, gulong>> probes;
+    us_timer_t *timer = nullptr;
+    JsonWriter json{64 * 1024};
+
+    static GstBuffer * firstBuffer(GstPadProbeInfo *info) {
+      if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        auto const list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        return gst_buffer_list_length(list) > 0 ? gst_buffer_list_get(list, 0) : nullptr;
+      }
+      return GST_PAD_PROBE_INFO_BUFFER(info);
+    }
+
+    // Buffers going into an element that has src pads, for the time until they come out
+    static GstPadProbeReturn arrived(GstPad *, GstPadProbeInfo *info, gpointer data) {
+      auto& stage = *static_cast<Probe*>(data)->stage;
+      auto const buffer = firstBuffer(info);
+      if (!buffer || !GST_BUFFER_PTS_IS_VALID(buffer)) { return GST_PAD_PROBE_OK; }
+
+      auto const now = g_get_monotonic_time();
+      auto const lock = std::lock_guard{stage.mutex};
+      stage.arrivals.emplace_back(GST_BUFFER_PTS(buffer), now);
+      if (stage.arrivals.size() > max_arrivals) { stage.arrivals.pop_front(); }
+      return GST_PAD_PROBE_OK;
+    }
+
+    // Buffers coming out of an element, or going into a sink
+    static GstPadProbeReturn departed(GstPad *, GstPadProbeInfo *info, gpointer data) {
+      auto& probe = *static_cast<Probe*>(data);
+      auto& stage = *probe.stage;
+      auto const now = g_get_monotonic_time();
+
+      auto count = std::uint64_t{1};
+      auto bytes = std::uint64_t{};
+      if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        auto const list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        count = gst_buffer_list_length(list);
+        bytes = gst_buffer_list_calculate_size(list);
+      } else {
+        bytes = gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+      }
+
+      // Read before taking the lock, as the queue takes its own
+      auto level = guint{};
+      if (stage.queue) {
+        g_object_get(stage.element, "current-level-buffers", &level, nullptr);
+      }
+
+      auto const buffer = firstBuffer(info);
+      auto arrival = std::optional<gint64>{};
+      {
+        auto const lock = std::lock_guard{stage.mutex};
+        stage.buffers += count;
+        stage.bytes += bytes;
+        if (stage.last_out) { stage.interval.record(std::uint64_t(now - stage.last_out)); }
+        stage.last_out = now;
+
+        // A buffer the element split or merged matches the first arrival with its PTS; older arrivals never came out
+        if (buffer && GST_BUFFER_PTS_IS_VALID(buffer)) {
+          auto const match = std::find_if(stage.arrivals.begin(), stage.arrivals.end(), [&] (auto& arrival) { return arrival.first == GST_BUFFER_PTS(buffer); });
+          if (match != stage.arrivals.end()) {
+            arrival = match->second;
+            stage.processing.record(std::uint64_t(now - match->second));
+            stage.arrivals.erase(stage.arrivals.begin(), match + 1);
+          }
+        }
+
+        if (stage.queue) {
+          ++stage.level_samples;
+          stage.level_sum += level;
+          stage.level_max = std::max(stage.level_max, level);
+        }
+      }
+
+      if (arrival) { probe.session->trace('X', stage.name, *arrival, now - *arrival); }
+      if (stage.queue) { probe.session->trace('C', stage.name, now, level); }
+      return GST_PAD_PROBE_OK;
+    }
+
+    void addProbe(GstPad *pad, GstPadProbeCallback callback, Stage& stage) {
+      auto const id = gst_pad_add_probe
+        ( pad
+        , GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST)
+        , callback
+        , new Probe{session, &stage}
+        , [] (gpointer data) { delete static_cast<Probe*>(data); }
+        );
+      probes.emplace_back(GST_PAD(gst_object_ref(pad)), id);
+    }
+
+    // Probes the src pads of an element, or the sink pads of a sink, and the sink pads of a filter to time what it does
+    void probe(GstElement *element) {
+      if (GST_IS_BIN(element)) { return; } // the elements inside are probed themselves
+
+      auto pads = std::vector<GstPad*>{};
+      gst_element_foreach_pad
+        ( element
+        , [] (GstElement *, GstPad *pad, gpointer data) { static_cast<std::vector<GstPad*>*>(data)->push_back(GST_PAD(gst_object_ref(pad))); return gboolean(TRUE); }
+        , &pads
+        );
+      auto const src = std::count_if(pads.begin(), pads.end(), [] (auto pad) { return GST_PAD_DIRECTION(pad) == GST_PAD_SRC; });
+
+      auto& stage = session->stages.emplace_back(element);
+      stage.filter = src > 0 && std::size_t(src) < pads.size();
+      for (auto pad : pads) {
+        if (GST_PAD_DIRECTION(pad) == GST_PAD_SRC) {
+          addProbe(pad, &departed, stage);
+        } else {
+          addProbe(pad, src ? &arrived : &departed, stage);
+        }
+        gst_object_unref(pad);
+      }
+    }
+
+    void removeProbes() {
+      for (auto [pad, id] : probes) {
+        gst_pad_remove_probe(pad, id);
+        gst_object_unref(pad);
+      }
+      probes.clear();
+    }
+
+    void finish() {
+      removeProbes();
+      for (auto& route : session->routes) {
+        route.route->spans = nullptr;
+      }
+
+      json.clear();
+      if (session->options.chrome) {
+        writeTrace(&json);
+      } else {
+        writeSummary(&json);
+      }
+      (*reply)("200 OK", json.view());
+      reply.reset();
+      session.reset();
+    }
+
+    // {"seconds":N,"elements":[{"name":...,"factory":...,"buffers":N,"bytes":N,"interval":{...},"processing":{...},"queue_level":{"mean":N,"max":N}},...],
+    //  "handlers":[{"route":...,"count":N,"total_us":N,"max_us":N},...]}
+    // processing is only there for elements with sink and src pads, and queue_level for queues
+    void writeSummary(JsonWriter *out) {
+      out->write("{\"seconds\":");
+      writeData(out, session->options.seconds);
+      out->write(",\"elements\":[");
+      for (auto& stage : session->stages) {
+        auto const lock = std::lock_guard{stage.mutex};
+        if (&stage != &session->stages.front()) { out->write(','); }
+        out->write("{\"name\":");
+        out->writeString(stage.name);
+        out->write(",\"factory\":");
+        out->writeString(stage.factory);
+        writeField(out, "buffers", stage.buffers);
+        writeField(out, "bytes", stage.bytes);
+        out->write(",\"interval\":");
+        stage.interval.write(out);
+        if (stage.filter) {
+          out->write(",\"processing\":");
+          stage.processing.write(out);
+        }
+        if (stage.queue) {
+          out->write(",\"queue_level\":{\"mean\":");
+          writeData(out, stage.level_samples ? double(stage.level_sum) / double(stage.level_samples) : 0.0);
+          writeField(out, "max", stage.level_max);
+          out->write('}');
+        }
+        out->write('}');
+      }
+      out->write("],\"handlers\":[");
+      auto first = true;
+      for (auto& route : session->routes) {
+        if (route.spans.empty()) { continue; }
+        auto total = gint64{};
+        auto max = gint64{};
+        for (auto& span : route.spans) {
+          total += span.end - span.start;
+          max = std::max(max, span.end - span.start);
+        }
+        out->write(first ? "{\"route\":" : ",{\"route\":");
+        out->writeString(route.route->pattern);
+        writeField(out, "count", route.spans.size());
+        writeField(out, "total_us", total);
+        writeField(out, "max_us", max);
+        out->write('}');
+        first = false;
+      }
+      out->write("]}");
+    }
+
+    // The Trace Event Format: a span per buffer through each element and per request, and a counter per queue
+    void writeTrace(JsonWriter *out) {
+      auto const lock = std::lock_guard{session->trace_mutex};
+      for (auto& route : session->routes) {
+        for (auto& span : route.spans) {
+          if (session->events.size() == max_events) {
+            ++session->dropped;
+            continue;
+          }
+          session->events.push_back(Event{'X', route.route->pattern, session->thread(), span.start - session->start, span.end - span.start});
+        }
+      }
+
+      out->write("{\"traceEvents\":[");
+      for (auto i = std::size_t{}; i < session->threads.size(); ++i) {
+        if (i) { out->write(','); }
+        out->write("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":");
+        writeData(out, i);
+        out->write(",\"args\":{\"name\":");
+        out->writeString(session->threads[i].second);
+        out->write("}}");
+      }
+      for (auto& event : session->events) {
+        out->write(",{\"name\":");
+        out->writeString(event.name);
+        out->write(event.phase == 'X' ? ",\"ph\":\"X\"" : ",\"ph\":\"C\"");
+        writeField(out, "pid", 1);
+        writeField(out, "tid", event.thread);
+        writeField(out, "ts", event.time);
+        if (event.phase == 'X') {
+          writeField(out, "dur", event.value);
+        } else {
+          out->write(",\"args\":{\"buffers\":");
+          writeData(out, event.value);
+          out->write('}');
+        }
+        out->write('}');
+      }
+      out->write("],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":");
+      writeData(out, session->dropped);
+      out->write("}}");
+    }
+
+  public:
+    Profiler(Gst::Element pipeline, Metrics& metrics) : pipeline{pipeline}, metrics{metrics} {}
+
+    Profiler(Profiler const &) = delete;
+    Profiler& operator=(Profiler const &) = delete;
+
+    ~Profiler() {
+      removeProbes();
+    }
+
+    // Answers 409 if a profile is running already
+    void start(Options options, Routes::Reply reply) {
+      if (session || !timer) {
+        reply("409 Conflict");
+        return;
+      }
+      this->reply = std::move(reply);
+      session = std::make_shared<Session>(options);
+
+      auto const elements = gst_bin_iterate_recurse(GST_BIN(pipeline.get()));
+      gst_iterator_foreach
+        ( elements
+        , [] (GValue const *element, gpointer data) { static_cast<Profiler*>(data)->probe(GST_ELEMENT(g_value_get_object(element))); }
+        , this
+        );
+      gst_iterator_free(elements);
+
+      metrics.forEachRoute
+        ( [&] (Metrics::Route& route) {
+            auto& profiled = session->routes.emplace_back(Route{&route, {}});
+            route.spans = &profiled.spans;
+          }
+        );
+
+      us_timer_set
+        ( timer
+        , [] (us_timer_t *timer) { (*static_cast<Profiler**>(us_timer_ext(timer)))->finish(); }
+        , int(options.seconds * 1000)
+        , 0
+        );
+    }
+
+    // Must be called from the thread running the uWS loop
+    void attach() {
+      timer = us_create_timer(reinterpret_cast<us_loop_t*>(uWS::Loop::get()), 0, sizeof(Profiler*));
+      *static_cast<Profiler**>(us_timer_ext(timer)) = this;
+    }
+};
+
+// Holds back property writes from the control interface so that each property is set at most max-property-rate times a second,
+// however fast a slider sends them. A write to a property set less than an interval ago waits for the end of the interval, and
+// a newer write to the same property in the meantime supersedes it, so the last value is always the one applied.
+// Each write with a reply is answered once all its properties are settled, with {"accepted":[names],"superseded":[names]}:
+// accepted properties are queued for the main context, which sets them shortly after.
+// Only used on the web thread.
+class PropertyDebouncer {
+  private:
+    // One write from the control interface, answered once none of its properties is pending any more
+    struct Write {
+      std::optional<Routes::Reply> reply; // none for writes nobody waits on
+      std::size_t outstanding;
+      std::vector<std::string> accepted;
+      std::vector<std::string> superseded;
+    };
+
+    struct Property {
+      gint64 last_apply = 0;
+      std::optional<GLib::Value> pending;
+      std::shared_ptr<Write> write; // the write the pending value came from
+    };
+
+    std::function<bool(PropertyAssignments)> sink;
+    gint64 const interval; // µs
+    std::unordered_map<std::string, Property> properties;
+    us_timer_t *timer = nullptr;
+    JsonWriter json{256};
+
+    static void writeNames(JsonWriter *out, std::vector<std::string> const & names) {
+      out->write('[');
+      for (auto& name : names) {
+        if (&name != &names.front()) { out->write(','); }
+        out->writeString(name);
+      }
+      out->write(']');
+    }
+
+    void settle(std::shared_ptr<Write> const & write, std::string name, bool accepted) {
+      (accepted ? write->accepted : write->superseded).push_back(std::move(name));
+      finish(write);
+    }
+
+    void finish(std::shared_ptr<Write> const & write) {
+      if (--write->outstanding || !write->reply) { return; }
+
+      json.clear();
+      json.write("{\"accepted\":");
+      writeNames(&json, write->accepted);
+      json.write(",\"superseded\":");
+      writeNames(&json, write->superseded);
+      json.write('}');
+      (*write->reply)("200 OK", json.view());
+    }
+
+    // Applies every pending value that is due in one batch, and arms the timer for the rest
+    void flush() {
+      auto const now = g_get_monotonic_time();
+      auto batch = PropertyAssignments{};
+      auto next = std::optional<gint64>{};
+      for (auto& [name, property] : properties) {
+        if (!property.pending) { continue; }
+        if (auto const due = property.last_apply + interval; due > now) {
+          next = std::min(next.value_or(due), due);
+          continue;
+        }
+        auto value = *property.pending;
+        batch.add(name, value.release());
+      }
+
+      // If the writer's queue is full, everything stays pending and is retried a little later
+      if (!batch.empty() && !sink(std::move(batch))) {
+        next = now + interval;
+      } else {
+        for (auto& [name, property] : properties) {
+          if (!property.pending || property.last_apply + interval > now) { continue; }
+          property.last_apply = now;
+          property.pending.reset();
+          settle(std::exchange(property.write, nullptr), name, true);
+        }
+      }
+
+      if (next && timer) {
+        us_timer_set
+          ( timer
+          , [] (us_timer_t *timer) { (*static_cast<PropertyDebouncer**>(us_timer_ext(timer)))->flush(); }
+          , int(std::max((*next - now + 999) / 1000, gint64{1}))
+          , 0
+          );
+      }
+    }
+
+  public:
+    // max_rate in Hz, 0 for no limit; sink is where the writes go once due, returning false if it cannot take them yet
+    PropertyDebouncer(int max_rate, std::function<bool(PropertyAssignments)> sink)
+      : sink{std::move(sink)}
+      , interval{max_rate ? G_USEC_PER_SEC / max_rate : 0}
+      {}
+
+    PropertyDebouncer(PropertyDebouncer const &) = delete;
+    PropertyDebouncer& operator=(PropertyDebouncer const &) = delete;
+
+    void write(PropertyAssignments assignments, std::optional<Routes::Reply> reply = std::nullopt) {
+      auto const write = std::make_shared<Write>(Write{std::move(reply), assignments.size() + 1, {}, {}});
+      assignments.drain
+        ( [&] (std::string name, GValue value) {
+            auto& property = properties[name];
+            if (property.write) {
+              settle(std::exchange(property.write, nullptr), name, false);
+            }
+            property.pending = GLib::Value::adopt(value);
+            property.write = write;
+          }
+        );
+      flush();
+      // The extra count keeps a write from being answered before all its properties are in, and answers an empty one
+      finish(write);
+    }
+
+    // Must be called from the thread running the uWS loop
+    void attach() {
+      timer = us_create_timer(reinterpret_cast<us_loop_t*>(uWS::Loop::get()), 0, sizeof(PropertyDebouncer*));
+      *static_cast<PropertyDebouncer**>(us_timer_ext(timer)) = this;
+    }
+};
+
+// A binary protocol over WebSocket for controllers too small to build and parse the JSON API. Every message starts with an
+// opcode byte, and all fields are little-endian; a property is named by its id, its position in GET /binary's list, and its
+// value carries the tag of its type so that a controller can check it knows the layout.
+//   -> 0x01 list                                <- 0x82 [count u16] then per property [id u16][tag u8][flags u8][name length u8][name]
+//   -> 0x02 read [id u16]                       <- 0x81 value [id u16][tag u8][value]
+//   -> 0x03 write [id u16][tag u8][value]          (debounced like /set_property; subscribers see the new value)
+//   -> 0x04 subscribe [count u16][id u16]...    <- 0x81 value whenever a property in the latest subscription changes
+//                                               <- 0xff error [opcode u8][code u8]
+// Tags are those of property_types, 0 for a property of an unsupported type; bit 0 of the flags is set for a writable property.
+class BinaryControl {
+  public:
+    enum Op : std::uint8_t { list = 0x01, read = 0x02, write = 0x03, subscribe = 0x04, value = 0x81, listing = 0x82, error = 0xff };
+    enum Error : std::uint8_t { malformed = 1, unknown_property = 2, wrong_type = 3, not_writable = 4, invalid_value = 5, unknown_op = 6 };
+
+    // The properties one socket is subscribed to. Only used on the web thread.
+    struct Socket {
+      std::vector<std::uint16_t> subscribed;
+    };
+
+  private:
+    using WebSocket = uWS::WebSocket<false, true, Socket>;
+
+    struct Target {
+      uWS::Loop *loop;
+      uWS::App *app;
+    };
+
+    PropertiesSchema const & schema;
+    PropertyDebouncer& debouncer;
+    std::string const topic_prefix;
+    Target target;
+    std::atomic<Target*> attached = nullptr;
+    std::atomic<int> sockets = 0; // so that changes are not encoded while no controller is connected
+
+    std::string topic(std::size_t id) const {
+      return topic_prefix + std::to_string(id);
+    }
+
+    static void writeValue(std::string& out, PropertiesSchema const & schema, PropertiesSchema::Entry const & entry, GValue const & g_value) {
+      Binary::put(out, std::uint8_t(Op::value));
+      Binary::put(out, std::uint16_t(schema.id(entry)));
+      Binary::put(out, entry.type->tag);
+      entry.type->writeBinary(out, g_value);
+    }
+
+    static void notify(GObject *, GParamSpec *property, gpointer data) {
+      auto& self = *static_cast<BinaryControl*>(data);
+      if (!self.sockets.load(std::memory_order_relaxed)) { return; }
+
+      auto const target = self.attached.load(std::memory_order_acquire);
+      if (!target) { return; }
+
+      auto const entry = self.schema.find(g_param_spec_get_name(property));
+      if (!entry || !entry->type) { return; }
+
+      auto message = std::string{};
+      writeValue(message, self.schema, *entry, *entry->handle.copy().get());
+      target->loop->defer
+        ( [app = target->app, topic = self.topic(self.schema.id(*entry)), message = std::move(message)] () {
+            app->publish(topic, message, uWS::OpCode::BINARY);
+          }
+        );
+    }
+
+    static void fail(WebSocket *ws, std::uint8_t op, Error code) {
+      auto message = std::string{};
+      Binary::put(message, std::uint8_t(Op::error));
+      Binary::put(message, op);
+      Binary::put(message, std::uint8_t(code));
+      ws->send(message, uWS::OpCode::BINARY);
+    }
+
+    void writeList(std::string& out) const {
+      Binary::put(out, std::uint8_t(Op::listing));
+      Binary::put(out, std::uint16_t(schema.size()));
+      for (auto id = std::size_t{}; id < schema.size(); ++id) {
+        auto const & entry = *schema.at(id);
+        auto const name = std::string_view{g_param_spec_get_name(entry.property)}.substr(0, std::numeric_limits<std::uint8_t>::max());
+        Binary::put(out, std::uint16_t(id));
+        Binary::put(out, entry.type ? entry.type->tag : std::uint8_t{0});
+        Binary::put(out, std::uint8_t(entry.type && entry.writable() ? 1 : 0));
+        Binary::put(out, std::uint8_t(name.size()));
+        out.append(name);
+      }
+    }
+
+    // The property the next id in data names, which must be of a supported type
+    std::optional<Error> take(std::string_view& data, PropertiesSchema::Entry const *& entry) const {
+      auto const id = Binary::take<std::uint16_t>(data);
+      if (!id) { return Error::malformed; }
+      entry = schema.at(*id);
+      if (!entry || !entry->type) { return Error::unknown_property; }
+      return std::nullopt;
+    }
+
+    void message(WebSocket *ws, std::string_view data, uWS::OpCode code) {
+      if (code != uWS::OpCode::BINARY) {
+        fail(ws, 0, Error::malformed);
+        return;
+      }
+      auto const op = Binary::take<std::uint8_t>(data);
+      if (!op) {
+        fail(ws, 0, Error::malformed);
+        return;
+      }
+
+      auto const * entry = static_cast<PropertiesSchema::Entry const *>(nullptr);
+      auto reply = std::string{};
+      switch (*op) {
+        case Op::list:
+          if (!data.empty()) {
+            fail(ws, *op, Error::malformed);
+            return;
+          }
+          writeList(reply);
+          ws->send(reply, uWS::OpCode::BINARY);
+          return;
+
+        case Op::read:
+          if (auto const failure = take(data, entry)) {
+            fail(ws, *op, *failure);
+            return;
+          }
+          if (!data.empty()) {
+            fail(ws, *op, Error::malformed);
+            return;
+          }
+          writeValue(reply, schema, *entry, entry->handle.value());
+          ws->send(reply, uWS::OpCode::BINARY);
+          return;
+
+        case Op::write: {
+          if (auto const failure = take(data, entry)) {
+            fail(ws, *op, *failure);
+            return;
+          }
+          auto const tag = Binary::take<std::uint8_t>(data);
+          if (!tag) {
+            fail(ws, *op, Error::malformed);
+            return;
+          }
+          if (*tag != entry->type->tag) {
+            fail(ws, *op, Error::wrong_type);
+            return;
+          }
+          if (!entry->writable()) {
+            fail(ws, *op, Error::not_writable);
+            return;
+          }
+          auto assignments = PropertyAssignments{};
+          try {
+            assignments.add(g_param_spec_get_name(entry->property), entry->parse(data));
+          } catch (bad_request const &) {
+            fail(ws, *op, Error::invalid_value);
+            return;
+          }
+          // The value must fill the rest of the message exactly
+          if (!data.empty()) {
+            fail(ws, *op, Error::malformed);
+            return;
+          }
+          debouncer.write(std::move(assignments));
+          return;
+        }
+
+        case Op::subscribe: {
+          auto const count = Binary::take<std::uint16_t>(data);
+          if (!count || data.size() != *count * sizeof(std::uint16_t)) {
+            fail(ws, *op, Error::malformed);
+            return;
+          }
+          auto& subscribed = ws->getUserData()->subscribed;
+          for (auto id : subscribed) {
+            ws->unsubscribe(topic(id));
+          }
+          subscribed.clear();
+          for (auto i = std::uint16_t{}; i < *count; ++i) {
+            auto const id = *Binary::take<std::uint16_t>(data);
+            if (id >= schema.size()) { continue; }
+            ws->subscribe(topic(id));
+            subscribed.push_back(id);
+          }
+          return;
+        }
+
+        default:
+          fail(ws, *op, Error::unknown_op);
+          return;
+      }
+    }
+
+  public:
+    // Writes go through debouncer, like those of the JSON API; topics are named after id so several cameras can share an app
+    template <typename Object>
+    BinaryControl(Object& object, PropertiesSchema const & schema, PropertyDebouncer& debouncer, std::string const & id)
+      : schema{schema}
+      , debouncer{debouncer}
+      , topic_prefix{"binary/" + id + "/"}
+      {
+        object.connect("notify", G_CALLBACK(&notify), this);
+      }
+
+    BinaryControl(BinaryControl const &) = delete;
+    BinaryControl& operator=(BinaryControl const &) = delete;
+
+    // Registers the WebSocket at pattern, which may be done for several patterns
+    void serve(uWS::App& app, std::string const & pattern) {
+      auto behavior = uWS::App::WebSocketBehavior<Socket>{};
+      behavior.open = [this] (auto *) { sockets.fetch_add(1, std::memory_order_relaxed); };
+      behavior.message = [this] (auto *ws, std::string_view data, uWS::OpCode code) { message(ws, data, code); };
+      behavior.close = [this] (auto *, int, std::string_view) { sockets.fetch_sub(1, std::memory_order_relaxed); };
+      app.ws<Socket>(pattern, std::move(behavior));
+    }
+
+    // Must be called from the thread running app
+    void attach(uWS::App& app) {
+      target = Target{uWS::Loop::get(), &app};
+      attached.store(&target, std::memory_order_release);
+    }
+};
+
+// One camera and everything behind it. Each camera runs a pipeline of its own, so one that fails or stalls leaves the others
+// streaming; all of them share the GLib main context and the web thread, and serve their routes under a prefix.
+class Camera {
+  private:
+    // The elements the rest of the camera holds on to
+    struct Elements {
+      Gst::Pipeline pipeline;
+      Gst::Element source; // the head of the pipeline, rpicamsrc or a bin
+      Gst::Element control; // the element behind /properties, which may be inside the source
+      Gst::Element capsfilter;
+      Gst::Element udp_queue;
+      Gst::Element rtph264pay;
+      Gst::Element send_queue;
+      Gst::Element udpsink;
+      Gst::Element stream_sink;
+      std::optional<Gst::Element> rtpbin;
+      std::optional<Gst::Element> rtcpsink;
+      std::optional<Gst::Element> snapshot_queue;
+      std::optional<Gst::Element> snapshot_sink;
+      std::optional<Gst::Element> record_sink;
+      std::atomic<std::uint64_t>& udp_drops;
+      std::atomic<std::uint64_t>& stream_drops;
+    };
+
+    static Gst::Element source(Config const & config) {
+      if (config.source.empty()) {
+        auto rpicamsrc = Gst::Element{"rpicamsrc", "rpicamsrc"};
+        // SPS/PPS on every keyframe, so consumers that join mid-stream can start decoding at the next one
+        rpicamsrc["inline-headers"] = true;
+        return rpicamsrc;
+      }
+
+      GError *error = nullptr;
+      auto bin = Gst::Bin::parse(config.source.c_str(), &error);
+      if (!bin) {
+        // Config::validate parsed it already, so this is an element that has gone missing since; the camera stays idle
+        g_warning("Invalid source %s: %s", config.source.c_str(), error->message);
+        g_error_free(error);
+        auto idle = Gst::Element{"fakesrc", "source"};
+        idle["num-buffers"] = 0;
+        return idle;
+      }
+      (*bin)["name"] = "source";
+      return *bin;
+    }
+
+    static Elements build(std::string const & id, Config const & config, Metrics& metrics) {
+      // create pipeline
+      auto pipeline = Gst::Pipeline{id.c_str()};
+
+      // create elements
+      auto source = Camera::source(config);
+
+      auto capsfilter = Gst::Element{"capsfilter", "capsfilter"};
+      capsfilter["caps"] = Gst::caps_value(config.caps.c_str());
+
+      auto tee = Gst::Element{"tee", "tee"};
+
+      auto udp_queue = Gst::Element{"queue", "udp_queue"};
+
+      auto rtph264pay = Gst::Element{"rtph264pay", "rtph264pay"};
+
+      auto send_queue = Gst::Element{"queue", "send_queue"};
+
+      auto udpsink = Gst::Element{"multiudpsink", "udpsink"};
+      udpsink["clients"] = config.clients;
+
+      /* must add elements to pipeline before linking them */
+      pipeline.add(source);
+      pipeline.add(capsfilter);
+      pipeline.add(tee);
+      pipeline.add(udp_queue);
+      pipeline.add(rtph264pay);
+      pipeline.add(send_queue);
+      pipeline.add(udpsink);
+
+      /* link */
+      Gst::Element::link(source, capsfilter);
+      Gst::Element::link(capsfilter, tee);
+      Gst::Element::link(tee, udp_queue);
+      Gst::Element::link(udp_queue, rtph264pay);
+
+      auto control = pipeline.by_name(config.control.c_str());
+      if (!control) {
+        g_warning("No element %s in camera %s to control, serving the properties of its source", config.control.c_str(), id.c_str());
+      }
+
+      // With an RTCP port, an rtpbin between the payloader and the sink runs the RTCP session:
+      // sender reports go to port + 1 of every client, and their receiver reports come back on the RTCP port
+      auto rtpbin = std::optional<Gst::Element>{};
+      auto rtcpsink = std::optional<Gst::Element>{};
+      if (config.rtcp_port) {
+        rtpbin.emplace("rtpbin", "rtpbin");
+
+        rtcpsink.emplace("multiudpsink", "rtcpsink");
+        (*rtcpsink)["sync"] = false;
+        (*rtcpsink)["async"] = false;
+
+        auto rtcpsrc = Gst::Element{"udpsrc", "rtcpsrc"};
+        rtcpsrc["port"] = config.rtcp_port;
+        rtcpsrc["caps"] = Gst::caps_value("application/x-rtcp");
+
+        pipeline.add(*rtpbin);
+        pipeline.add(*rtcpsink);
+        pipeline.add(rtcpsrc);
+        Gst::Element::link_pads(rtph264pay, "src", *rtpbin, "send_rtp_sink_0");
+        Gst::Element::link_pads(*rtpbin, "send_rtp_src_0", send_queue, "sink");
+        Gst::Element::link_pads(*rtpbin, "send_rtcp_src_0", *rtcpsink, "sink");
+        Gst::Element::link_pads(rtcpsrc, "src", *rtpbin, "recv_rtcp_sink_0");
+      } else {
+        Gst::Element::link(rtph264pay, send_queue);
+      }
+      Gst::Element::link(send_queue, udpsink);
+
+      // Local consumers map the encoded stream straight out of shared memory, e.g. with
+      //   shmsrc socket-path=PATH is-live=true do-timestamp=true ! video/x-h264,stream-format=byte-stream,alignment=au ! h264parse ! ...
+      // Each shared buffer is exactly one access unit, and keyframes carry SPS/PPS so consumers can join at any time.
+      if (!config.shm_socket.empty()) {
+        // Leaky, so a consumer that stops reading makes us drop frames for it rather than stalling the camera
+        auto shm_queue = Gst::Element{"queue", "shm_queue"};
+        shm_queue.set_from_string("leaky", "downstream");
+        shm_queue["max-size-buffers"] = 30u;
+        shm_queue["max-size-bytes"] = 0u;
+        shm_queue["max-size-time"] = guint64{0};
+
+        auto shmsink = Gst::Element{"shmsink", "shmsink"};
+        shmsink["socket-path"] = config.shm_socket;
+        shmsink["shm-size"] = 4u * 1024 * 1024;
+        shmsink["wait-for-connection"] = false;
+        shmsink["sync"] = false;
+        shmsink["async"] = false;
+
+        pipeline.add(shm_queue);
+        pipeline.add(shmsink);
+        Gst::Element::link(tee, shm_queue);
+        Gst::Element::link(shm_queue, shmsink);
+        metrics.countDrops(shm_queue);
+      }
+
+      // Browser preview, leaky for the same reason as the shared memory branch
+      auto stream_queue = Gst::Element{"queue", "stream_queue"};
+      stream_queue.set_from_string("leaky", "downstream");
+      stream_queue["max-size-buffers"] = 30u;
+      stream_queue["max-size-bytes"] = 0u;
+      stream_queue["max-size-time"] = guint64{0};
+
+      auto stream_sink = Gst::Element{"appsink", "stream_sink"};
+
+      pipeline.add(stream_queue);
+      pipeline.add(stream_sink);
+      Gst::Element::link(tee, stream_queue);
+      Gst::Element::link(stream_queue, stream_sink);
+      auto& stream_drops = metrics.countDrops(stream_queue);
+
+      // Stills for /snapshot.jpg, only decoded and encoded when asked for
+      auto snapshot_queue = std::optional<Gst::Element>{};
+      auto snapshot_sink = std::optional<Gst::Element>{};
+      auto const snapshots = !config.snapshot_decoder.empty() && !config.snapshot_encoder.empty();
+      if (snapshots && (!Gst::has_factory(config.snapshot_decoder.c_str()) || !Gst::has_factory(config.snapshot_encoder.c_str()))) {
+        g_warning("No %s or %s, /snapshot.jpg is disabled", config.snapshot_decoder.c_str(), config.snapshot_encoder.c_str());
+      } else if (snapshots) {
+        snapshot_queue.emplace("queue", "snapshot_queue");
+        snapshot_queue->set_from_string("leaky", "downstream");
+        (*snapshot_queue)["max-size-buffers"] = 2u;
+        (*snapshot_queue)["max-size-bytes"] = 0u;
+        (*snapshot_queue)["max-size-time"] = guint64{0};
+
+        auto snapshot_decoder = Gst::Element{config.snapshot_decoder.c_str(), "snapshot_decoder"};
+        auto snapshot_encoder = Gst::Element{config.snapshot_encoder.c_str(), "snapshot_encoder"};
+        snapshot_sink.emplace("appsink", "snapshot_sink");
+
+        pipeline.add(*snapshot_queue);
+        pipeline.add(snapshot_decoder);
+        pipeline.add(snapshot_encoder);
+        pipeline.add(*snapshot_sink);
+        Gst::Element::link(tee, *snapshot_queue);
+        Gst::Element::link(*snapshot_queue, snapshot_decoder);
+        Gst::Element::link(snapshot_decoder, snapshot_encoder);
+        Gst::Element::link(snapshot_encoder, *snapshot_sink);
+      }
+
+      // Pre-event ring for /record/start
+      auto record_sink = std::optional<Gst::Element>{};
+      if (!config.record_directory.empty()) {
+        auto record_queue = Gst::Element{"queue", "record_queue"};
+        record_queue.set_from_string("leaky", "downstream");
+        record_queue["max-size-buffers"] = 0u;
+        record_queue["max-size-bytes"] = 0u;
+        record_queue["max-size-time"] = guint64{GST_SECOND};
+
+        record_sink.emplace("fakesink", "record_sink");
+
+        pipeline.add(record_queue);
+        pipeline.add(*record_sink);
+        Gst::Element::link(tee, record_queue);
+        Gst::Element::link(record_queue, *record_sink);
+        metrics.countDrops(record_queue);
+      }
+
+      // The low resolution stream, for consumers that only show thumbnails. The camera encodes a single stream, so this one is
+      // decoded, scaled and encoded again, all in hardware. videorate drops frames before scaling to the framerate of secondary-caps.
+      if (!config.secondary_clients.empty()) {
+        auto const factories = {&config.secondary_decoder, &config.secondary_scaler, &config.secondary_encoder};
+        auto const missing = std::find_if(factories.begin(), factories.end(), [] (auto factory) { return !Gst::has_factory(factory->c_str()); });
+        if (missing != factories.end()) {
+          g_warning("No %s, the secondary stream is disabled", (*missing)->c_str());
+        } else {
+          // Leaky, so a slow decoder drops frames of the secondary stream only
+          auto secondary_queue = Gst::Element{"queue", "secondary_queue"};
+          secondary_queue.set_from_string("leaky", "downstream");
+          secondary_queue["max-size-buffers"] = 0u;
+          secondary_queue["max-size-bytes"] = 0u;
+          secondary_queue["max-size-time"] = guint64{GST_SECOND / 2};
+
+          auto secondary_decoder = Gst::Element{config.secondary_decoder.c_str(), "secondary_decoder"};
+          auto secondary_rate = Gst::Element{"videorate", "secondary_rate"};
+          secondary_rate["drop-only"] = true;
+          auto secondary_scaler = Gst::Element{config.secondary_scaler.c_str(), "secondary_scaler"};
+          auto secondary_capsfilter = Gst::Element{"capsfilter", "secondary_capsfilter"};
+          secondary_capsfilter["caps"] = Gst::caps_value(config.secondary_caps.c_str());
+
+          auto secondary_encoder = Gst::Element{config.secondary_encoder.c_str(), "secondary_encoder"};
+          if (secondary_encoder.property("extra-controls")) {
+            // v4l2h264enc takes its bitrate and GOP length as V4L2 controls; one keyframe a second at the secondary framerate
+            auto const caps = std::unique_ptr<GstCaps, void (*)(GstCaps*)>{gst_caps_from_string(config.secondary_caps.c_str()), gst_caps_unref};
+            auto numerator = 0;
+            auto denominator = 1;
+            auto const period = gst_caps_get_size(caps.get()) && gst_structure_get_fraction(gst_caps_get_structure(caps.get(), 0), "framerate", &numerator, &denominator)
+              ? std::max(numerator / std::max(denominator, 1), 1)
+              : 30;
+            auto const controls = "controls,video_bitrate=" + std::to_string(config.secondary_bitrate) + ",h264_i_frame_period=" + std::to_string(period);
+            secondary_encoder.set_from_string("extra-controls", controls.c_str());
+          } else if (secondary_encoder.property("bitrate")) {
+            secondary_encoder["bitrate"] = config.secondary_bitrate;
+          }
+
+          auto secondary_pay = Gst::Element{"rtph264pay", "secondary_pay"};
+          // Unlike rpicamsrc, the encoder may send SPS/PPS only once, so the payloader repeats them with every keyframe
+          secondary_pay["config-interval"] = -1;
+
+          auto secondary_sink = Gst::Element{"multiudpsink", "secondary_sink"};
+          secondary_sink["clients"] = config.secondary_clients;
+          secondary_sink["sync"] = false;
+          secondary_sink["async"] = false;
+
+          for (auto element : {secondary_queue, secondary_decoder, secondary_rate, secondary_scaler, secondary_capsfilter, secondary_encoder, secondary_pay, secondary_sink}) {
+            pipeline.add(element);
+          }
+          Gst::Element::link(tee, secondary_queue);
+          Gst::Element::link(secondary_queue, secondary_decoder);
+          Gst::Element::link(secondary_decoder, secondary_rate);
+          Gst::Element::link(secondary_rate, secondary_scaler);
+          Gst::Element::link(secondary_scaler, secondary_capsfilter);
+          Gst::Element::link(secondary_capsfilter, secondary_encoder);
+          Gst::Element::link(secondary_encoder, secondary_pay);
+          Gst::Element::link(secondary_pay, secondary_sink);
+          metrics.countDrops(secondary_queue);
+        }
+      }
+
+      metrics.countFrames(source, "src");
+      metrics.countPackets(udpsink, "sink");
+      auto& udp_drops = metrics.countDrops(udp_queue);
+
+      config.apply(pipeline);
+      return Elements
+        { pipeline
+        , source
+        , control ? *control : source
+        , capsfilter
+        , udp_queue
+        , rtph264pay
+        , send_queue
+        , udpsink
+        , stream_sink
+        , rtpbin
+        , rtcpsink
+        , snapshot_queue
+        , snapshot_sink
+        , record_sink
+        , udp_drops
+        , stream_drops
+        };
+    }
+
+  public:
+    std::string const id;
+    Config const config;
+    Metrics metrics;
+
+  private:
+    Elements elements;
+    PipelineWatch watch;
+    ThreadAffinity const affinity;
+    VideoStream video_stream;
+    std::optional<Snapshot> snapshot;
+    std::optional<Recorder> recorder;
+    std::optional<GopDropper> gop_dropper;
+    PropertiesSchema const schema;
+    PropertyPublisher publisher;
+    PropertyWriter<Gst::Element> writer;
+    UdpClients clients;
+    std::optional<BitrateController> bitrate_controller;
+    StreamCaps stream_caps;
+    LatencyProbes latency;
+    // Only used on the web thread
+    PropertiesResponse properties;
+    Presets presets;
+    PropertyDebouncer debouncer;
+    BinaryControl binary;
+    Profiler profiler;
+
+  public:
+    // Builds the pipeline and sets it playing; started is when the process started, for the startup metrics
+    Camera(std::string id, Config config, gint64 started)
+      : id{std::move(id)}
+      , config{std::move(config)}
+      , elements{build(this->id, this->config, metrics)}
+      , watch{elements.pipeline, elements.source, metrics, started}
+      , affinity{elements.pipeline, this->config.affinity}
+      , video_stream{elements.stream_sink, elements.stream_drops}
+      , snapshot{elements.snapshot_sink ? std::optional<Snapshot>{std::in_place, *elements.snapshot_queue, *elements.snapshot_sink} : std::nullopt}
+      , recorder
+        { elements.record_sink
+        ? std::optional<Recorder>{std::in_place, *elements.record_sink, Recorder::Settings{this->config.record_directory, this->config.record_pre_seconds, this->config.record_segment_seconds}}
+        : std::nullopt
+        }
+      , schema{elements.control}
+      , publisher{elements.control, schema, "properties/" + this->id}
+      , writer{elements.control, elements.capsfilter}
+      , clients{elements.udpsink, elements.rtcpsink}
+      , stream_caps{elements.pipeline, elements.capsfilter, elements.source}
+      , latency{elements.pipeline}
+      , properties{schema, publisher}
+      , presets{schema, this->config.presets_file}
+      , debouncer{this->config.max_property_rate, [this] (PropertyAssignments assignments) { return write(std::move(assignments)); }}
+      , binary{elements.control, schema, debouncer, this->id}
+      , profiler{elements.pipeline, metrics}
+      {
+        if (this->config.drop_gops) {
+          gop_dropper.emplace(elements.udp_queue, elements.udp_drops);
+        }
+        if (elements.rtpbin) {
+          bitrate_controller.emplace
+            ( *elements.rtpbin
+            , schema
+            , writer
+            , BitrateController::Bounds{this->config.min_bitrate, this->config.max_bitrate, this->config.max_quantisation_parameter}
+            );
+        }
+        watch.onError([this] () { stream_caps.revert(); });
+        latency.add("encoder", elements.source, "src");
+        latency.add("udp_queue", elements.udp_queue, "src");
+        latency.add("rtph264pay", elements.rtph264pay, "src");
+        latency.add("send_queue", elements.send_queue, "src");
+        latency.add("udpsink", elements.udpsink, "sink");
+
+        elements.pipeline.set_state(GST_STATE_PLAYING);
+      }
+
+    Camera(Camera const &) = delete;
+    Camera& operator=(Camera const &) = delete;
+
+    void stop() {
+      elements.pipeline.set_state(GST_STATE_NULL);
+    }
+
+    // Writes from the control interface, forcing a keyframe if they change any of keyframe-properties
+    bool write(PropertyAssignments assignments) {
+      auto const & keyframe = config.keyframe_properties;
+      if (std::any_of(keyframe.begin(), keyframe.end(), [&] (auto const & name) { return assignments.sets(name); })) {
+        assignments.forceKeyframe();
+      }
+      return writer.write(std::move(assignments));
+    }
+
+    // Registers the routes of the camera under prefix, which may be done for several prefixes
+    void serve(Routes& routes, std::string const & prefix) {
+      routes.app.get(prefix + "/properties", Routes::timed(metrics.route(prefix + "/properties"), [this] (auto *res, auto *req) { properties.handle(res, req); }));
+      routes.post(metrics, prefix + "/set_property", [this] (std::string_view json, Routes::Reply reply) { debouncer.write(parse_set_property(schema, json), reply); });
+      routes.post(metrics, prefix + "/set_properties", [this] (std::string_view json, Routes::Reply reply) { debouncer.write(parse_set_properties(schema, json), reply); });
+      routes.get(metrics, prefix + "/clients", [this] (JsonWriter *out) { clients.write(out); });
+      routes.post
+        ( metrics
+        , prefix + "/clients"
+        , [this] (std::string_view json) {
+            auto const [host, port] = UdpClients::parse(json);
+            if (clients.contains(host, port)) { return "409 Conflict"; }
+            clients.add(host, port);
+            return "204 No Content";
+          }
+        );
+      routes.app.options(prefix + "/clients/*", Routes::cors_preflight);
+      routes.del
+        ( metrics
+        , prefix + "/clients/:host/:port"
+        , [this] (auto *req) {
+            auto const host = std::string{req->getParameter(0)};
+            auto const port = UdpClients::parsePort(req->getParameter(1));
+
+            auto const found = clients.contains(host, port);
+            if (found) {
+              clients.remove(host, port);
+            }
+            return found;
+          }
+        );
+      routes.get(metrics, prefix + "/pipeline", [this] (JsonWriter *out) { stream_caps.write(out); });
+      routes.post
+        ( metrics
+        , prefix + "/pipeline"
+        , [this] (std::string_view json) {
+            stream_caps.set(stream_caps.parse(json));
+            return "202 Accepted";
+          }
+        );
+      routes.get(metrics, prefix + "/latency", [this] (JsonWriter *out) { latency.write(out); });
+      routes.post
+        ( metrics
+        , prefix + "/latency"
+        , [this] (std::string_view json) {
+            latency.enable(LatencyProbes::parse(json));
+            return "204 No Content";
+          }
+        );
+      // Not wrapped in Routes::timed, as the still is usually sent later: Snapshot records the request once it has answered it
+      routes.app.get
+        ( prefix + "/snapshot.jpg"
+        , [this, &route = metrics.route(prefix + "/snapshot.jpg")] (auto *res, auto *) {
+            if (snapshot) {
+              snapshot->get(res, route);
+            } else {
+              auto const start = g_get_monotonic_time();
+              res->writeStatus("404 Not Found");
+              res->writeHeader("Access-Control-Allow-Origin", "*");
+              res->end();
+              route.record(start);
+            }
+          }
+        );
+      if (recorder) {
+        routes.get(metrics, prefix + "/record", [this] (JsonWriter *out) { recorder->write(out); });
+        routes.post(metrics, prefix + "/record/start", [this] (std::string_view) { return recorder->start() ? "202 Accepted" : "409 Conflict"; });
+        routes.post(metrics, prefix + "/record/stop", [this] (std::string_view) { return recorder->stop() ? "202 Accepted" : "409 Conflict"; });
+      }
+      routes.get(metrics, prefix + "/presets", [this] (JsonWriter *out) { presets.write(out); });
+      routes.post
+        ( metrics
+        , prefix + "/presets/:name"
+        , [this] (std::string_view json, std::string_view name) {
+            presets.save(name, json);
+            return "204 No Content";
+          }
+        );
+      routes.post
+        ( metrics
+        , prefix + "/presets/:name/apply"
+        , [this] (std::string_view, std::string_view name, Routes::Reply reply) {
+            auto assignments = presets.get(name);
+            if (!assignments) {
+              reply("404 Not Found");
+              return;
+            }
+            debouncer.write(std::move(*assignments), reply);
+          }
+        );
+      routes.app.options(prefix + "/presets/*", Routes::cors_preflight);
+      routes.del(metrics, prefix + "/presets/:name", [this] (auto *req) { return presets.remove(req->getParameter(0)); });
+      routes.get(metrics, prefix + "/metrics", [this] (JsonWriter *out) { metrics.write(out, writer.counters()); }, "text/plain; version=0.0.4");
+
+      struct PropertySocket {};
+      auto property_behavior = uWS::App::WebSocketBehavior<PropertySocket>{};
+      property_behavior.open = [this] (auto *ws) {
+          ws->subscribe(publisher.topic());
+        };
+      routes.app.ws<PropertySocket>(prefix + "/ws", std::move(property_behavior));
+      routes.app.get
+        ( prefix + "/debug/profile"
+        , [this, &route = metrics.route(prefix + "/debug/profile")] (auto *res, auto *req) {
+            auto const start = g_get_monotonic_time();
+            try {
+              profiler.start(Profiler::parse(req), Routes::Reply{res, route, start});
+            } catch (bad_request const & e) {
+              res->writeStatus("400 Bad Request");
+              res->writeHeader("Access-Control-Allow-Origin", "*");
+              res->end(e.what());
+              route.record(start);
+            }
+          }
+        );
+      binary.serve(routes.app, prefix + "/binary");
+      video_stream.attach(routes.app, prefix + "/stream");
+    }
+
+    // Starts what runs on the web thread, once the routes are registered; must be called from the thread running app
+    void attach(uWS::App& app) {
+      publisher.attach(app);
+      debouncer.attach();
+      binary.attach(app);
+      profiler.attach();
+      if (bitrate_controller) {
+        bitrate_controller->attach();
+      }
+      if (snapshot) {
+        snapshot->attach();
+      }
+    }
+};
+
+// The benchmarks in bench/ include this file for its classes and bring their own main
+#ifndef RPI_CAM_CONTROL_NO_MAIN
+int main(int argc, char **argv) {
+  auto const started = g_get_monotonic_time();
+
+  // init
+  auto const config = Config::load(argc, argv);
+  if (!config) { return 1; }
+
+  auto camera_configs = std::vector<std::pair<std::string, Config>>{};
+  if (config->cameras.empty()) {
+    camera_configs.emplace_back("0", *config);
+  }
+  for (auto const & entry : config->cameras) {
+    auto camera = config->camera(entry);
+    if (!camera) { return 1; }
+    camera_configs.emplace_back(entry.first, std::move(*camera));
+  }
+
+  auto loop = std::unique_ptr<GMainLoop, void (*)(GMainLoop*)>{g_main_loop_new(nullptr, FALSE), g_main_loop_unref};
+
+  // The control interface listens while the cameras are still being built, and answers 503 until their routes are registered.
+  // app and routes are only touched on the web thread.
+  auto app = std::optional<uWS::App>{};
+  auto routes = std::optional<Routes>{};
+  auto ready = false;
+  auto listened_after = gint64{};
+  auto web_loop = std::promise<uWS::Loop*>{};
+  auto web_thread = std::thread
+    ( [&] () {
+        app.emplace();
+        routes.emplace(*app);
+        app->any
+          ( "/*"
+          , [&ready] (auto *res, auto *) {
+              res->writeStatus(ready ? "404 Not Found" : "503 Service Unavailable");
+              res->writeHeader("Access-Control-Allow-Origin", "*");
+              if (!ready) {
+                res->writeHeader("Retry-After", "1");
+              }
+              res->end();
+            }
+          );
+        app->listen(config->port, [&](auto *listenSocket) {
+          if (listenSocket) {
+            listened_after = g_get_monotonic_time() - started;
+            std::cout << "Listening for connections after " << listened_after / 1000 << "ms..." << std::endl;
+          }
+        });
+        web_loop.set_value(uWS::Loop::get());
+        app->run();
+      }
+    );
+
+  // create a pipeline per camera
+  auto cameras = std::deque<Camera>{};
+  for (auto& [id, camera_config] : camera_configs) {
+    cameras.emplace_back(id, std::move(camera_config), started);
+  }
+
+  web_loop.get_future().get()->defer
+    ( [&] () {
+        // The first camera also answers on the unprefixed routes, which are all there is with a single camera
+        cameras.front().serve(*routes, "");
+        for (auto& camera : cameras) {
+          camera.serve(*routes, "/cams/" + camera.id);
+          camera.metrics.listened(listened_after);
+        }
+        routes->get
+          ( cameras.front().metrics
+          , "/cams"
+          , [&] (JsonWriter *out) {
+              out->write('[');
+              for (auto& camera : cameras) {
+                if (&camera != &cameras.front()) { out->write(','); }
+                out->writeString(camera.id);
+              }
+              out->write(']');
+            }
+          );
+        for (auto& camera : cameras) {
+          camera.attach(*app);
+        }
+        ready = true;
+      }
+    );
+
+  // Iterate
+  g_print("Running...\n");
+  g_main_loop_run(loop.get());
 
   // Out of the main loop, clean up nicely
   g_print("Returned, stopping playback\n");
-  pipeline.set_state(GST_STATE_NULL);
+  for (auto& camera : cameras) {
+    camera.stop();
+  }
 }
+#endif